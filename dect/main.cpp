@@ -27,6 +27,13 @@
 #include <stdlib.h>
 #include <math.h>
 #include <iostream>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <algorithm>
+#include <string.h>
 
 #ifdef _MSC_VER
 #include <tchar.h>
@@ -55,6 +62,7 @@ int dect_algo;
 
 #define DEF_MINSTEP 0.001f
 #define DEF_MERGEFACT 0.5f
+#define DEF_ROWSPERSTRIP 32
 
 static float alphaa = DEF_ALPHAA;
 static float betaa = DEF_BETAA;
@@ -66,6 +74,14 @@ static float min_step = DEF_MINSTEP;
 int enhanced = 1;
 static float merge_fact = DEF_MERGEFACT;
 static int quiet = 0;
+static int hybrid = 0;
+static double warm_start = 0.0;
+static double slice_warm_start = 0.0;
+static uint32_t rows_per_strip = DEF_ROWSPERSTRIP;
+static uint32_t stream_rows = 0;
+
+/* The device for -C, with the plain algorithm and its own state */
+static libdect_context *compare_ctx = NULL;
 
 static int16_t *readTIFFDirectory(TIFF *f, size_t *buf_size)
 {
@@ -82,16 +98,22 @@ static int16_t *readTIFFDirectory(TIFF *f, size_t *buf_size)
 		}
 	}
 
+	/* The last strip may be shorter than the others */
 	auto ssize = TIFFStripSize(f);
-	auto size = ssize * TIFFNumberOfStrips(f);
-	buf = (char *)_TIFFmalloc(size);
+	buf = (char *)_TIFFmalloc(ssize * TIFFNumberOfStrips(f));
+	tsize_t size = 0;
 	for (strip = 0; strip < TIFFNumberOfStrips(f); strip++)
 	{
-		auto read = TIFFReadEncodedStrip(f, strip, &buf[strip * ssize], ssize);
-		assert(read == ssize);
+		auto read = TIFFReadEncodedStrip(f, strip, &buf[size], ssize);
+		assert(read >= 0);
+		size += read;
 	}
 
-	int sf = SAMPLEFORMAT_UINT;
+	uint32_t il;
+	TIFFGetField(f, TIFFTAG_IMAGELENGTH, &il);
+	assert(size == TIFFScanlineSize(f) * (tsize_t)il);
+
+	uint16_t sf = SAMPLEFORMAT_UINT;
 	TIFFGetField(f, TIFFTAG_SAMPLEFORMAT, &sf);
 
 	int16_t *ret = (int16_t *)buf;
@@ -110,20 +132,939 @@ static int16_t *readTIFFDirectory(TIFF *f, size_t *buf_size)
 	return ret;
 }
 
-static uint8_t *readTIFFDirectory2(TIFF *f, size_t *buf_size)
+/* An input file mapped into memory, so that uncompressed directories
+	can be processed in place */
+struct input_map
 {
-	tdata_t buf;
-	tstrip_t strip;
-	buf = _TIFFmalloc(TIFFStripSize(f));
-	auto size = TIFFStripSize(f);
-	for (strip = 0; strip < TIFFNumberOfStrips(f); strip++)
-		TIFFReadEncodedStrip(f, strip, buf, (tsize_t)-1);
+	TIFF *f;
+	void *base;
+	toff_t size;
+};
 
-	uint8_t *ret = (uint8_t *)buf;
+static void mapInput(TIFF *f, input_map *map)
+{
+	map->f = f;
+	map->base = NULL;
+	map->size = 0;
 
-	*buf_size = (size_t)size;
+	auto map_proc = TIFFGetMapFileProc(f);
+	if (!map_proc || !map_proc(TIFFClientdata(f), &map->base, &map->size))
+	{
+		map->base = NULL;
+		map->size = 0;
+	}
+}
 
-	return ret;
+static void unmapInput(input_map *map)
+{
+	if (map->base)
+		TIFFGetUnmapFileProc(map->f)(TIFFClientdata(map->f), map->base,
+			map->size);
+	map->base = NULL;
+}
+
+/* The current directory's samples within the mapped file, if they are
+	stored there exactly as the algorithm reads them: uncompressed 16 bit
+	single samples in strips which follow one another, in this machine's
+	byte order.  Unsigned samples are left offset by 32768, which
+	*is_unsigned reports, for the algorithm to remove as it reads them.
+	Returns NULL if the directory must be decoded instead. */
+static const int16_t *mapTIFFDirectory(const input_map *map,
+	size_t *buf_size, int *is_unsigned)
+{
+	auto f = map->f;
+	if (!map->base || TIFFIsTiled(f) || TIFFIsByteSwapped(f))
+		return NULL;
+
+	uint16_t compression, bps, spp, sf;
+	TIFFGetFieldDefaulted(f, TIFFTAG_COMPRESSION, &compression);
+	TIFFGetFieldDefaulted(f, TIFFTAG_BITSPERSAMPLE, &bps);
+	TIFFGetFieldDefaulted(f, TIFFTAG_SAMPLESPERPIXEL, &spp);
+	TIFFGetFieldDefaulted(f, TIFFTAG_SAMPLEFORMAT, &sf);
+	if (compression != COMPRESSION_NONE || bps != 16 || spp != 1 ||
+		(sf != SAMPLEFORMAT_UINT && sf != SAMPLEFORMAT_INT))
+		return NULL;
+
+	uint32_t iw, il;
+	if (!TIFFGetField(f, TIFFTAG_IMAGEWIDTH, &iw) ||
+		!TIFFGetField(f, TIFFTAG_IMAGELENGTH, &il))
+		return NULL;
+
+	uint64_t *offsets, *counts;
+	if (!TIFFGetField(f, TIFFTAG_STRIPOFFSETS, &offsets) ||
+		!TIFFGetField(f, TIFFTAG_STRIPBYTECOUNTS, &counts))
+		return NULL;
+
+	uint64_t size = (uint64_t)iw * il * 2;
+	uint64_t stored = 0;
+	auto nstrips = TIFFNumberOfStrips(f);
+	for (tstrip_t strip = 0; strip < nstrips && stored < size; strip++)
+	{
+		if (offsets[strip] != offsets[0] + stored)
+			return NULL;
+		stored += counts[strip];
+	}
+
+	if (stored < size || (offsets[0] & 1) || offsets[0] > map->size ||
+		size > map->size - offsets[0])
+		return NULL;
+
+	*buf_size = (size_t)(size / 2);
+	*is_unsigned = sf == SAMPLEFORMAT_UINT;
+	return (const int16_t *)((const uint8_t *)map->base + offsets[0]);
+}
+
+/* The output type an output image was written in */
+static libdect_output_type outputType(TIFF *f)
+{
+	uint16_t bps = 8;
+	uint16_t sf = SAMPLEFORMAT_UINT;
+	TIFFGetField(f, TIFFTAG_BITSPERSAMPLE, &bps);
+	TIFFGetField(f, TIFFTAG_SAMPLEFORMAT, &sf);
+
+	if (sf == SAMPLEFORMAT_IEEEFP)
+		return bps == 64 ? libdect_output_type::f64 : libdect_output_type::f32;
+	return bps == 16 ? libdect_output_type::u16 : libdect_output_type::u8;
+}
+
+static size_t outputSize(libdect_output_type otype)
+{
+	switch (otype)
+	{
+	case libdect_output_type::u16:
+		return 2;
+	case libdect_output_type::f32:
+		return 4;
+	case libdect_output_type::f64:
+		return 8;
+	default:
+		return 1;
+	}
+}
+
+/* Read an output image of type otype, returning its size in voxels */
+static uint8_t *readTIFFDirectory2(TIFF *f, libdect_output_type otype,
+	size_t *pix_count)
+{
+	auto ssize = TIFFStripSize(f);
+	auto size = ssize * TIFFNumberOfStrips(f);
+	uint8_t *buf = (uint8_t *)_TIFFmalloc(size);
+	tsize_t total = 0;
+	for (tstrip_t strip = 0; strip < TIFFNumberOfStrips(f); strip++)
+	{
+		auto read = TIFFReadEncodedStrip(f, strip, &buf[total], ssize);
+		assert(read >= 0);
+		total += read;
+	}
+
+	*pix_count = (size_t)total / outputSize(otype);
+
+	return buf;
+}
+
+static double outputValue(const void *buf, size_t idx, libdect_output_type otype)
+{
+	switch (otype)
+	{
+	case libdect_output_type::u16:
+		return (double)((const uint16_t *)buf)[idx] / 65535.0;
+	case libdect_output_type::f32:
+		return (double)((const float *)buf)[idx];
+	case libdect_output_type::f64:
+		return ((const double *)buf)[idx];
+	default:
+		return (double)((const uint8_t *)buf)[idx] / 255.0;
+	}
+}
+
+/* How far apart the results of two devices are, summed over the parts
+	of a frame that were compared */
+struct compare_result
+{
+	double max_diff;
+	double sum_sq;
+	size_t diff_count;
+	size_t count;
+};
+
+/* Re-run the frame, or part of it, on the comparison device and add how
+	far apart the results are, as a fraction of full scale, to res */
+static void compareDevice(int unsigned_input,
+	const int16_t *a, const int16_t *b,
+	const void *x, const void *y, const void *z,
+	size_t pix_count, size_t out_size,
+	libdect_output_type otype, int idx_adjust, compare_result *res)
+{
+	void *cx = malloc(out_size);
+	void *cy = malloc(out_size);
+	void *cz = malloc(out_size);
+
+	dect_contextSetOption(compare_ctx, libdect_option::unsigned_input,
+		unsigned_input);
+	auto algo_ret = dect_contextProcess(compare_ctx,
+		a, b, alphaa, betaa, gammaa,
+		alphab, betab, gammab,
+		cx, cy, cz, pix_count, min_step, NULL, merge_fact,
+		idx_adjust);
+	if (algo_ret != 0)
+	{
+		std::cerr << "ERROR: DECT algorithm failed on comparison device" << std::endl;
+		exit(0);
+	}
+
+	const void *outs[] = { x, y, z };
+	const void *couts[] = { cx, cy, cz };
+
+	for (int c = 0; c < 3; c++)
+	{
+		for (size_t idx = 0; idx < pix_count; idx++)
+		{
+			auto diff = fabs(outputValue(outs[c], idx, otype) -
+				outputValue(couts[c], idx, otype));
+			if (diff > res->max_diff)
+				res->max_diff = diff;
+			if (diff > 0.0)
+				res->diff_count++;
+			res->sum_sq += diff * diff;
+		}
+	}
+	res->count += 3 * pix_count;
+
+	free(cx);
+	free(cy);
+	free(cz);
+}
+
+static void reportComparison(int device_id, int frame_id,
+	const compare_result *res)
+{
+	printf("Frame %i vs device %i: max difference %.6f, RMS difference %.6f, %.2f%% of values differ\n",
+		frame_id, device_id, res->max_diff,
+		sqrt(res->sum_sq / (double)res->count),
+		100.0 * (double)res->diff_count / (double)res->count);
+}
+
+/* One pair of input directories and everything needed to write out
+	the results, so frames can be passed between pipeline stages */
+struct frame
+{
+	int frame_id;
+	const int16_t *a, *b;
+	size_t pix_count;
+	size_t out_size;
+	void *x, *y, *z;
+	int16_t *m;
+	libdect_stats stats;
+
+	/* a and b point into the mapped input files rather than buffers of
+		their own, and hold unsigned samples offset by 32768 */
+	int mapped;
+	int unsigned_input;
+
+	/* Fields copied from the directory in file A */
+	uint32_t iw, il;
+	uint16_t o, ru, ph;
+	float xp, yp, xr, yr;
+};
+
+/* Bounded queue between pipeline stages.  push() blocks while the
+	queue is full and pop() returns NULL once the queue is empty and
+	the producer has called close(). */
+class frame_queue
+{
+public:
+	frame_queue(size_t max_frames) : max_frames(max_frames), closed(false) {}
+
+	void push(frame *f)
+	{
+		std::unique_lock<std::mutex> lock(mtx);
+		not_full.wait(lock, [this] { return frames.size() < max_frames; });
+		frames.push_back(f);
+		not_empty.notify_one();
+	}
+
+	frame *pop()
+	{
+		std::unique_lock<std::mutex> lock(mtx);
+		not_empty.wait(lock, [this] { return !frames.empty() || closed; });
+		if (frames.empty())
+			return NULL;
+		auto f = frames.front();
+		frames.pop_front();
+		not_full.notify_one();
+		return f;
+	}
+
+	void close()
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		closed = true;
+		not_empty.notify_all();
+	}
+
+private:
+	std::deque<frame *> frames;
+	size_t max_frames;
+	bool closed;
+	std::mutex mtx;
+	std::condition_variable not_full, not_empty;
+};
+
+/* Frames which may wait between each pair of stages in pipelined mode */
+#define PIPELINE_DEPTH 2
+
+/* Copy the fields the outputs share with A from its current directory */
+static void readFrameFields(TIFF *af, frame *f)
+{
+	int ret;
+	f->o = ORIENTATION_TOPLEFT;
+	f->xp = 0.0f;
+	f->yp = 0.0f;
+	ret = TIFFGetField(af, TIFFTAG_IMAGEWIDTH, &f->iw);
+	assert(ret == 1);
+	ret = TIFFGetField(af, TIFFTAG_IMAGELENGTH, &f->il);
+	assert(ret == 1);
+	ret = TIFFGetField(af, TIFFTAG_ORIENTATION, &f->o);
+	//assert(ret == 1);
+	ret = TIFFGetField(af, TIFFTAG_RESOLUTIONUNIT, &f->ru);
+	assert(ret == 1);
+	ret = TIFFGetField(af, TIFFTAG_PHOTOMETRIC, &f->ph);
+	assert(ret == 1);
+	if (TIFFGetField(af, TIFFTAG_XPOSITION, &f->xp) != 1)
+		f->xp = 0;
+	if (TIFFGetField(af, TIFFTAG_YPOSITION, &f->yp) != 1)
+		f->yp = 0;
+	ret = TIFFGetField(af, TIFFTAG_XRESOLUTION, &f->xr);
+	assert(ret == 1);
+	ret = TIFFGetField(af, TIFFTAG_YRESOLUTION, &f->yr);
+	assert(ret == 1);
+}
+
+static frame *readFrame(const input_map *amap, const input_map *bmap,
+	int frame_id, libdect_output_type otype, int merged)
+{
+	auto af = amap->f;
+	auto bf = bmap->f;
+	size_t a_len, b_len;
+	int a_unsigned, b_unsigned;
+	auto f = new frame();
+
+	f->frame_id = frame_id;
+	f->a = mapTIFFDirectory(amap, &a_len, &a_unsigned);
+	f->b = mapTIFFDirectory(bmap, &b_len, &b_unsigned);
+	f->mapped = f->a && f->b && a_unsigned == b_unsigned;
+	if (f->mapped)
+		f->unsigned_input = a_unsigned;
+	else
+	{
+		f->a = readTIFFDirectory(af, &a_len);
+		f->b = readTIFFDirectory(bf, &b_len);
+	}
+
+	assert(f->a);
+	assert(f->b);
+	assert(a_len == b_len);
+
+	f->pix_count = a_len;
+	f->out_size = a_len;
+
+	switch (otype)
+	{
+	case libdect_output_type::u16:
+		f->out_size *= 2;
+		break;
+	case libdect_output_type::f32:
+		f->out_size *= 4;
+		break;
+	case libdect_output_type::f64:
+		f->out_size *= 8;
+		break;
+	}
+
+	f->x = malloc(f->out_size);
+	f->y = malloc(f->out_size);
+	f->z = malloc(f->out_size);
+
+	f->m = NULL;
+	if (merged)
+		f->m = (int16_t *)malloc(a_len * 2);
+
+	readFrameFields(af, f);
+	return f;
+}
+
+/* Start the algorithm on a frame, returning before it completes on
+	OpenCL devices */
+static libdect_job *submitFrame(frame *f, int do_rotate)
+{
+	libdect_job *job;
+	dect_setOption(libdect_option::unsigned_input, f->unsigned_input);
+	auto algo_ret = dect_processAsync(
+		dect_algo, enhanced,
+		f->a, f->b, alphaa, betaa, gammaa,
+		alphab, betab, gammab,
+		f->x, f->y, f->z, f->pix_count, min_step, f->m, merge_fact,
+		do_rotate ? ((int)f->pix_count - 1) : 0, &job);
+	if (algo_ret != 0)
+	{
+		std::cerr << "ERROR: DECT algorithm failed" << std::endl;
+		exit(0);
+	}
+	return job;
+}
+
+static void finishFrame(frame *f, libdect_job *job, int compare_device,
+	libdect_output_type otype, int do_rotate)
+{
+	auto algo_ret = dect_wait(job);
+	if (algo_ret != 0)
+	{
+		std::cerr << "ERROR: DECT algorithm failed" << std::endl;
+		exit(0);
+	}
+
+	dect_getStats(&f->stats);
+
+	if (compare_device >= 0)
+	{
+		compare_result res = {};
+		compareDevice(f->unsigned_input,
+			f->a, f->b, f->x, f->y, f->z, f->pix_count, f->out_size, otype,
+			do_rotate ? ((int)f->pix_count - 1) : 0, &res);
+		reportComparison(compare_device, f->frame_id, &res);
+	}
+}
+
+static void processFrame(frame *f, int compare_device,
+	libdect_output_type otype, int do_rotate)
+{
+	finishFrame(f, submitFrame(f, do_rotate), compare_device, otype,
+		do_rotate);
+}
+
+/* Process frames of the same size as one volume, in a single call */
+static void processVolume(std::vector<frame *> &frames, int compare_device,
+	libdect_output_type otype, int do_rotate)
+{
+	auto first = frames[0];
+	for (auto it = frames.begin(); it < frames.end(); it++)
+	{
+		if ((*it)->iw != first->iw || (*it)->il != first->il ||
+			(*it)->pix_count != first->pix_count)
+		{
+			std::cerr << "ERROR: Frames must all be the same size to process as a volume" << std::endl;
+			exit(0);
+		}
+	}
+
+	auto pix_count = first->pix_count;
+	auto out_size = first->out_size;
+	auto depth = frames.size();
+
+	auto a = (int16_t *)malloc(pix_count * depth * 2);
+	auto b = (int16_t *)malloc(pix_count * depth * 2);
+	auto x = (uint8_t *)malloc(out_size * depth);
+	auto y = (uint8_t *)malloc(out_size * depth);
+	auto z = (uint8_t *)malloc(out_size * depth);
+	int16_t *m = NULL;
+	if (first->m)
+		m = (int16_t *)malloc(pix_count * depth * 2);
+
+	/* Mapped unsigned frames are moved into the signed range as they are
+		packed, since they are being copied anyway */
+	for (size_t i = 0; i < depth; i++)
+	{
+		auto f = frames[i];
+		int16_t flip = f->unsigned_input ? INT16_MIN : 0;
+		for (size_t idx = 0; idx < pix_count; idx++)
+		{
+			a[i * pix_count + idx] = f->a[idx] ^ flip;
+			b[i * pix_count + idx] = f->b[idx] ^ flip;
+		}
+	}
+	dect_setOption(libdect_option::unsigned_input, 0);
+
+	auto algo_ret = dect_processVolume(
+		dect_algo, enhanced,
+		a, b, alphaa, betaa, gammaa,
+		alphab, betab, gammab,
+		x, y, z, first->iw, first->il, depth, 0, 0,
+		min_step, m, merge_fact, do_rotate);
+	if (algo_ret != 0)
+	{
+		std::cerr << "ERROR: DECT algorithm failed" << std::endl;
+		exit(0);
+	}
+
+	libdect_stats stats;
+	dect_getStats(&stats);
+
+	for (size_t i = 0; i < depth; i++)
+	{
+		auto f = frames[i];
+		memcpy(f->x, x + i * out_size, out_size);
+		memcpy(f->y, y + i * out_size, out_size);
+		memcpy(f->z, z + i * out_size, out_size);
+		if (m)
+			memcpy(f->m, m + i * pix_count, pix_count * 2);
+
+		if (compare_device >= 0)
+		{
+			compare_result res = {};
+			compareDevice(0,
+				a + i * pix_count, b + i * pix_count,
+				f->x, f->y, f->z, f->pix_count, f->out_size, otype,
+				do_rotate ? ((int)f->pix_count - 1) : 0, &res);
+			reportComparison(compare_device, f->frame_id, &res);
+		}
+	}
+
+	if (quiet == 0)
+	{
+		printf("Processed volume of %zu frames", depth);
+		if (hybrid)
+			printf(", %zu voxels searched (%.1f%%)", stats.fallback_count,
+				100.0 * (double)stats.fallback_count / (double)stats.pix_count);
+		if (stats.unique_pairs)
+			printf(", %zu distinct pairs (%.1f%% of voxels)", stats.unique_pairs,
+				100.0 * (double)stats.unique_pairs / (double)stats.pix_count);
+		printf("\n");
+	}
+
+	free(a);
+	free(b);
+	free(x);
+	free(y);
+	free(z);
+	free(m);
+}
+
+/* A growable in-memory file, so that strips can be compressed by
+	libtiff on any thread without touching the output files */
+struct mem_file
+{
+	std::vector<uint8_t> data;
+	size_t pos;
+};
+
+static tmsize_t memRead(thandle_t h, void *buf, tmsize_t size)
+{
+	auto mf = (mem_file *)h;
+	size_t n = std::min((size_t)size, mf->data.size() - std::min(mf->pos, mf->data.size()));
+	if (n)
+		memcpy(buf, &mf->data[mf->pos], n);
+	mf->pos += n;
+	return (tmsize_t)n;
+}
+
+static tmsize_t memWrite(thandle_t h, void *buf, tmsize_t size)
+{
+	auto mf = (mem_file *)h;
+	if (mf->pos + (size_t)size > mf->data.size())
+		mf->data.resize(mf->pos + (size_t)size);
+	memcpy(&mf->data[mf->pos], buf, (size_t)size);
+	mf->pos += (size_t)size;
+	return size;
+}
+
+static toff_t memSeek(thandle_t h, toff_t off, int whence)
+{
+	auto mf = (mem_file *)h;
+	switch (whence)
+	{
+	case SEEK_CUR:
+		mf->pos += (size_t)off;
+		break;
+	case SEEK_END:
+		mf->pos = mf->data.size() + (size_t)off;
+		break;
+	default:
+		mf->pos = (size_t)off;
+		break;
+	}
+	return (toff_t)mf->pos;
+}
+
+static int memClose(thandle_t h)
+{
+	(void)h;
+	return 0;
+}
+
+static toff_t memSize(thandle_t h)
+{
+	return (toff_t)((mem_file *)h)->data.size();
+}
+
+static int memMap(thandle_t h, void **base, toff_t *size)
+{
+	(void)h;
+	(void)base;
+	(void)size;
+	return 0;
+}
+
+static void memUnmap(thandle_t h, void *base, toff_t size)
+{
+	(void)h;
+	(void)base;
+	(void)size;
+}
+
+/* LZW compress rows of an output plane into out, by writing them as
+	the only strip of a scratch in-memory TIFF, closing it and reading
+	the raw strip back from a read-only handle to the same memory */
+static void encodeStrip(const frame *f, const void *buf, uint32_t rows,
+	uint16_t bps, int sf, std::vector<uint8_t> &out)
+{
+	mem_file mf;
+	mf.pos = 0;
+
+	auto t = TIFFClientOpen("strip", "w", (thandle_t)&mf,
+		memRead, memWrite, memSeek, memClose, memSize, memMap, memUnmap);
+	assert(t);
+
+	TIFFSetField(t, TIFFTAG_IMAGEWIDTH, f->iw);
+	TIFFSetField(t, TIFFTAG_IMAGELENGTH, rows);
+	TIFFSetField(t, TIFFTAG_ROWSPERSTRIP, rows);
+	TIFFSetField(t, TIFFTAG_SAMPLESPERPIXEL, 1);
+	TIFFSetField(t, TIFFTAG_BITSPERSAMPLE, bps);
+	TIFFSetField(t, TIFFTAG_SAMPLEFORMAT, sf);
+	TIFFSetField(t, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+	TIFFSetField(t, TIFFTAG_PHOTOMETRIC, f->ph);
+	TIFFSetField(t, TIFFTAG_COMPRESSION, COMPRESSION_LZW);
+
+	auto size = (tsize_t)f->iw * rows * (bps / 8);
+	auto ret = TIFFWriteEncodedStrip(t, 0, (void *)buf, size);
+	assert(ret == size);
+	TIFFClose(t);
+
+	mf.pos = 0;
+	auto r = TIFFClientOpen("strip", "r", (thandle_t)&mf,
+		memRead, memWrite, memSeek, memClose, memSize, memMap, memUnmap);
+	assert(r);
+
+	auto raw_size = TIFFRawStripSize(r, 0);
+	out.resize((size_t)raw_size);
+	ret = TIFFReadRawStrip(r, 0, out.data(), raw_size);
+	assert(ret == raw_size);
+
+	TIFFClose(r);
+}
+
+static void setOutputFields(TIFF *t, const frame *f, uint16_t bps, int sf)
+{
+	int ret;
+	uint16_t comp = COMPRESSION_LZW;
+	uint16_t spp = 1;
+	uint16_t pc = PLANARCONFIG_CONTIG;
+
+	ret = TIFFSetField(t, TIFFTAG_IMAGEWIDTH, f->iw);
+	assert(ret == 1);
+	ret = TIFFSetField(t, TIFFTAG_IMAGELENGTH, f->il);
+	assert(ret == 1);
+	ret = TIFFSetField(t, TIFFTAG_SAMPLESPERPIXEL, spp);
+	assert(ret == 1);
+	ret = TIFFSetField(t, TIFFTAG_BITSPERSAMPLE, bps);
+	assert(ret == 1);
+	ret = TIFFSetField(t, TIFFTAG_ORIENTATION, f->o);
+	assert(ret == 1);
+	ret = TIFFSetField(t, TIFFTAG_PLANARCONFIG, pc);
+	assert(ret == 1);
+	ret = TIFFSetField(t, TIFFTAG_COMPRESSION, comp);
+	assert(ret == 1);
+	ret = TIFFSetField(t, TIFFTAG_RESOLUTIONUNIT, f->ru);
+	assert(ret == 1);
+	ret = TIFFSetField(t, TIFFTAG_PHOTOMETRIC, f->ph);
+	assert(ret == 1);
+	ret = TIFFSetField(t, TIFFTAG_XPOSITION, f->xp);
+	assert(ret == 1);
+	ret = TIFFSetField(t, TIFFTAG_YPOSITION, f->yp);
+	assert(ret == 1);
+	ret = TIFFSetField(t, TIFFTAG_XRESOLUTION, f->xr);
+	assert(ret == 1);
+	ret = TIFFSetField(t, TIFFTAG_YRESOLUTION, f->yr);
+	assert(ret == 1);
+	ret = TIFFSetField(t, TIFFTAG_SAMPLEFORMAT, sf);
+	assert(ret == 1);
+}
+
+/* An output image and the buffer its rows are written from */
+struct output_plane
+{
+	TIFF *t;
+	const uint8_t *buf;
+	uint16_t bps;
+	int sf;
+};
+
+/* The output images of a frame, written from its x, y, z and m, returning
+	how many there are */
+static int outputPlanes(const frame *f, TIFF *cf, TIFF *df, TIFF *ef,
+	TIFF *mf, libdect_output_type otype, output_plane *planes)
+{
+	uint16_t bps = 8;
+	int sf = 1;
+	switch (otype)
+	{
+	case libdect_output_type::u16:
+		bps = 16;
+		break;
+	case libdect_output_type::f32:
+		bps = 32;
+		sf = 3;
+		break;
+	case libdect_output_type::f64:
+		bps = 64;
+		sf = 3;
+		break;
+	}
+
+	planes[0] = { cf, (const uint8_t *)f->x, bps, sf };
+	planes[1] = { df, (const uint8_t *)f->y, bps, sf };
+	planes[2] = { ef, (const uint8_t *)f->z, bps, sf };
+	planes[3] = { mf, (const uint8_t *)f->m, 16, 2 };
+	return f->m ? 4 : 3;
+}
+
+/* Compress the strips of rows strip rows each which cover row_count rows
+	from first_row, the start of a strip, in parallel, then write them in
+	order.  The planes' buffers hold just those rows. */
+static void writeStrips(const frame *f, const output_plane *planes,
+	int nplanes, uint32_t rows, uint32_t first_row, uint32_t row_count)
+{
+	uint32_t first_strip = first_row / rows;
+	uint32_t nstrips = (row_count + rows - 1) / rows;
+
+	std::vector<std::vector<uint8_t>> strips((size_t)nplanes * nstrips);
+
+#pragma omp parallel for schedule(dynamic)
+	for (long long i = 0; i < (long long)strips.size(); i++)
+	{
+		auto &p = planes[i / nstrips];
+		uint32_t strip = (uint32_t)(i % nstrips);
+		uint32_t strip_row = strip * rows;
+		uint32_t strip_rows = std::min(rows, row_count - strip_row);
+		size_t row_size = (size_t)f->iw * (p.bps / 8);
+
+		encodeStrip(f, p.buf + strip_row * row_size, strip_rows, p.bps, p.sf,
+			strips[i]);
+	}
+
+	for (int i = 0; i < nplanes; i++)
+	{
+		for (uint32_t strip = 0; strip < nstrips; strip++)
+		{
+			auto &enc = strips[(size_t)i * nstrips + strip];
+			TIFFWriteRawStrip(planes[i].t, first_strip + strip, enc.data(),
+				(tsize_t)enc.size());
+		}
+	}
+}
+
+static void reportFrame(const frame *f)
+{
+	switch (quiet)
+	{
+	case 0:
+		printf("Processed frame %i", f->frame_id);
+		if (hybrid && f->stats.pix_count)
+			printf(", %zu voxels searched (%.1f%%)", f->stats.fallback_count,
+				100.0 * (double)f->stats.fallback_count / (double)f->stats.pix_count);
+		if (f->stats.unique_pairs)
+			printf(", %zu distinct pairs (%.1f%% of voxels)", f->stats.unique_pairs,
+				100.0 * (double)f->stats.unique_pairs / (double)f->stats.pix_count);
+		printf("\n");
+		break;
+	case 2:
+		printf(".\n");
+		break;
+	}
+}
+
+/* Write out and free a processed frame.  The strips of all the output
+	planes are compressed in parallel, then written in order. */
+static void writeFrame(frame *f, TIFF *cf, TIFF *df, TIFF *ef, TIFF *mf,
+	libdect_output_type otype)
+{
+	output_plane planes[4];
+	int nplanes = outputPlanes(f, cf, df, ef, mf, otype, planes);
+
+	uint32_t rows = f->il;
+	if (rows_per_strip && rows_per_strip < rows)
+		rows = rows_per_strip;
+
+	for (int i = 0; i < nplanes; i++)
+	{
+		setOutputFields(planes[i].t, f, planes[i].bps, planes[i].sf);
+		int ret = TIFFSetField(planes[i].t, TIFFTAG_ROWSPERSTRIP, rows);
+		assert(ret == 1);
+	}
+
+	writeStrips(f, planes, nplanes, rows, 0, f->il);
+
+	for (int i = 0; i < nplanes; i++)
+		TIFFWriteDirectory(planes[i].t);
+
+	if (!f->mapped)
+	{
+		_TIFFfree((void *)f->a);
+		_TIFFfree((void *)f->b);
+	}
+
+	free(f->x);
+	free(f->y);
+	free(f->z);
+	free(f->m);
+
+	reportFrame(f);
+
+	delete f;
+}
+
+/* Read rows of the current directory into buf as signed values.  They
+	must be read in order down the image, as compressed strips can only be
+	decoded that way. */
+static void readTIFFRows(TIFF *f, uint32_t row, uint32_t rows, int16_t *buf)
+{
+	uint16_t bps;
+	if (TIFFGetField(f, TIFFTAG_BITSPERSAMPLE, &bps))
+	{
+		if (bps != 16)
+		{
+			std::cerr << "Invalid input bits per sample in A: " << bps << std::endl;
+			abort();
+		}
+	}
+
+	uint32_t iw;
+	auto ret = TIFFGetField(f, TIFFTAG_IMAGEWIDTH, &iw);
+	assert(ret == 1);
+
+	for (uint32_t r = 0; r < rows; r++)
+	{
+		ret = TIFFReadScanline(f, buf + (size_t)r * iw, row + r, 0);
+		assert(ret == 1);
+	}
+
+	uint16_t sf = SAMPLEFORMAT_UINT;
+	TIFFGetField(f, TIFFTAG_SAMPLEFORMAT, &sf);
+	if (sf == SAMPLEFORMAT_UINT)
+	{
+		for (size_t i = 0; i < (size_t)rows * iw; i++)
+			buf[i] = (int16_t)((int32_t)((uint16_t *)buf)[i] - 32768);
+	}
+}
+
+/* Process a frame a window of rows at a time, writing each window's
+	output strips before the next is read, so that the memory needed
+	depends on the window and the width but not the height.  The window is
+	rounded up to whole output strips.  When rotating, the windows are
+	still read down A and B but written up the outputs. */
+static void streamFrame(const input_map *amap, const input_map *bmap,
+	int frame_id, TIFF *cf, TIFF *df, TIFF *ef, TIFF *mf,
+	libdect_output_type otype, int compare_device, int do_rotate,
+	uint32_t window_rows)
+{
+	auto af = amap->f;
+	auto bf = bmap->f;
+	frame f = frame();
+	f.frame_id = frame_id;
+	readFrameFields(af, &f);
+
+	uint32_t bw, bl;
+	int ret = TIFFGetField(bf, TIFFTAG_IMAGEWIDTH, &bw);
+	assert(ret == 1);
+	ret = TIFFGetField(bf, TIFFTAG_IMAGELENGTH, &bl);
+	assert(ret == 1);
+	assert(bw == f.iw && bl == f.il);
+
+	size_t a_len, b_len;
+	int a_unsigned, b_unsigned;
+	auto ma = mapTIFFDirectory(amap, &a_len, &a_unsigned);
+	auto mb = mapTIFFDirectory(bmap, &b_len, &b_unsigned);
+	f.mapped = ma && mb && a_unsigned == b_unsigned;
+	f.unsigned_input = f.mapped ? a_unsigned : 0;
+
+	/* Without a strip size of its own, each window is one strip */
+	uint32_t rows = rows_per_strip ? rows_per_strip : window_rows;
+	rows = std::max(std::min(rows, f.il), (uint32_t)1);
+	uint32_t window = (window_rows + rows - 1) / rows * rows;
+	window = std::min(std::max(window, rows), f.il);
+
+	size_t window_pix = (size_t)window * f.iw;
+	auto osize = outputSize(otype);
+	std::vector<int16_t> wa, wb, wm;
+	if (!f.mapped)
+	{
+		wa.resize(window_pix);
+		wb.resize(window_pix);
+	}
+	std::vector<uint8_t> wx(window_pix * osize);
+	std::vector<uint8_t> wy(window_pix * osize);
+	std::vector<uint8_t> wz(window_pix * osize);
+	if (mf)
+		wm.resize(window_pix);
+
+	f.x = wx.data();
+	f.y = wy.data();
+	f.z = wz.data();
+	f.m = mf ? wm.data() : NULL;
+
+	output_plane planes[4];
+	int nplanes = outputPlanes(&f, cf, df, ef, mf, otype, planes);
+	for (int i = 0; i < nplanes; i++)
+	{
+		setOutputFields(planes[i].t, &f, planes[i].bps, planes[i].sf);
+		ret = TIFFSetField(planes[i].t, TIFFTAG_ROWSPERSTRIP, rows);
+		assert(ret == 1);
+	}
+
+	libdect_stats total = {};
+	compare_result res = {};
+	uint32_t nwindows = (f.il + window - 1) / window;
+	for (uint32_t w = 0; w < nwindows; w++)
+	{
+		uint32_t out_row = (do_rotate ? nwindows - 1 - w : w) * window;
+		uint32_t count = std::min(window, f.il - out_row);
+		uint32_t in_row = do_rotate ? f.il - out_row - count : out_row;
+
+		if (f.mapped)
+		{
+			f.a = ma + (size_t)in_row * f.iw;
+			f.b = mb + (size_t)in_row * f.iw;
+		}
+		else
+		{
+			readTIFFRows(af, in_row, count, wa.data());
+			readTIFFRows(bf, in_row, count, wb.data());
+			f.a = wa.data();
+			f.b = wb.data();
+		}
+		f.pix_count = (size_t)count * f.iw;
+		f.out_size = f.pix_count * osize;
+
+		processFrame(&f, -1, otype, do_rotate);
+		total.pix_count += f.stats.pix_count;
+		total.unique_pairs += f.stats.unique_pairs;
+		total.fallback_count += f.stats.fallback_count;
+
+		if (compare_device >= 0)
+			compareDevice(f.unsigned_input,
+				f.a, f.b, f.x, f.y, f.z, f.pix_count, f.out_size, otype,
+				do_rotate ? ((int)f.pix_count - 1) : 0, &res);
+
+		writeStrips(&f, planes, nplanes, rows, out_row, count);
+	}
+
+	for (int i = 0; i < nplanes; i++)
+		TIFFWriteDirectory(planes[i].t);
+
+	if (compare_device >= 0)
+		reportComparison(compare_device, frame_id, &res);
+
+	f.stats = total;
+	reportFrame(&f);
 }
 
 /* Convert TCHAR* to UTF-8 for passing to libtiff */
@@ -161,13 +1102,30 @@ static void help(TCHAR *fname)
 	std::cout << " -E                  even bias for materials - slower" << std::endl;
 	std::cout << " -M file             generate a merged image file too" << std::endl;
 	std::cout << " -r ratio            ratio of A:B to use for merged image (defaults to " << DEF_MERGEFACT << ")" << std::endl;
-	std::cout << " -F                  rotate output images 180 degrees" << std::endl;
+	std::cout << " -F                  rotate output images, including the merged image, 180 degrees" << std::endl;
 	std::cout << " -S                  use single precision floating point during calculations" << std::endl;
 	std::cout << " -U                  unsigned 16 bit output (default is u8)" << std::endl;
 	std::cout << " -s                  single precision floating point output (default is u8)" << std::endl;
 	std::cout << " -t                  double precision floating point output (default is u8)" << std::endl;
 	std::cout << " -q                  suppress progress output" << std::endl;
 	std::cout << " -R                  reconstitute source images (overwrites source)" << std::endl;
+	std::cout << " -X                  reconstitute and report each frame's RMS difference from A and B" << std::endl;
+	std::cout << " -N                  solve every voxel, rather than each distinct (A, B) pair once" << std::endl;
+	std::cout << " -H                  CPU: only search where the simultaneous equations give no valid solution" << std::endl;
+	std::cout << " -l                  CPU: solve every possible (A, B) pair once and look voxels up" << std::endl;
+	std::cout << " -k                  CPU: find the exact least squares solution rather than searching" << std::endl;
+	std::cout << " -C device_number    report the difference from the results of another device" << std::endl;
+	std::cout << " -T threads          maximum number of CPU threads to use (defaults to all)" << std::endl;
+	std::cout << " -P                  read and write frames in parallel with processing" << std::endl;
+	std::cout << " -W rows             rows per output strip, 0 for one strip per image (defaults to " << DEF_ROWSPERSTRIP << ")" << std::endl;
+	std::cout << " -K                  OpenCL: build kernels specialized for the given densities" << std::endl;
+	std::cout << " -G                  OpenCL: solve with the simultaneous equations - fast but inaccurate" << std::endl;
+	std::cout << " -V                  read every frame and process them as one volume" << std::endl;
+	std::cout << " -L value            only solve voxels where A or B is at least value, e.g. -500 to skip air (not with -D 1 or -G)" << std::endl;
+	std::cout << " -O fill             fraction to output for voxels skipped by -L (defaults to 0)" << std::endl;
+	std::cout << " -w error            CPU: start from the previous voxel's solution where its error is within error HU" << std::endl;
+	std::cout << " -I error            CPU: start from the previous slice's solution where its error is within error HU (implies -N)" << std::endl;
+	std::cout << " -Y rows             read, process and write rows at a time, in whole output strips, to bound memory use" << std::endl;
 	std::cout << " -h                  display this help" << std::endl;
 	std::cout << std::endl;
 	std::cout << "Devices" << std::endl;
@@ -180,7 +1138,6 @@ static void help(TCHAR *fname)
 
 int _tmain(int argc, TCHAR *argv[])
 {
-	size_t a_len, b_len;
 	dect_algo = 0;
 
 	TCHAR *afname = NULL;
@@ -195,10 +1152,22 @@ int _tmain(int argc, TCHAR *argv[])
 	int do_rotate = 0;
 	int reconstitute = 0;
 	int use_single_fp = 0;
+	int dedup_pairs = 1;
+	int compare_device = -1;
+	int max_threads = 0;
+	int pipelined = 0;
+	int specialize = 0;
+	int volume = 0;
+	int mask_below = INT16_MIN;
+	double mask_fill = 0.0;
+	int simul = 0;
+	int use_lut = 0;
+	int use_exact = 0;
+	int validate = 0;
 	libdect_output_type otype = libdect_output_type::u8;
 
 	int g;
-	while ((g = getopt(argc, argv, _T("qA:B:x:y:z:D:a:b:c:d:e:f:g:hm:EM:r:FZRSUst"))) != -1)
+	while ((g = getopt(argc, argv, _T("qA:B:x:y:z:D:a:b:c:d:e:f:g:hm:EM:r:FZRSUstNC:HT:PW:KGVL:O:w:I:XY:lk"))) != -1)
 	{
 		switch (g)
 		{
@@ -278,6 +1247,11 @@ int _tmain(int argc, TCHAR *argv[])
 			reconstitute = 1;
 			break;
 
+		case 'X':
+			reconstitute = 1;
+			validate = 1;
+			break;
+
 		case 'S':
 			use_single_fp = 1;
 			break;
@@ -294,6 +1268,70 @@ int _tmain(int argc, TCHAR *argv[])
 			otype = libdect_output_type::f64;
 			break;
 
+		case 'N':
+			dedup_pairs = 0;
+			break;
+
+		case 'C':
+			compare_device = _ttoi(optarg);
+			break;
+
+		case 'H':
+			hybrid = 1;
+			break;
+
+		case 'l':
+			use_lut = 1;
+			break;
+
+		case 'k':
+			use_exact = 1;
+			break;
+
+		case 'T':
+			max_threads = _ttoi(optarg);
+			break;
+
+		case 'P':
+			pipelined = 1;
+			break;
+
+		case 'W':
+			rows_per_strip = (uint32_t)_ttoi(optarg);
+			break;
+
+		case 'K':
+			specialize = 1;
+			break;
+
+		case 'G':
+			simul = 1;
+			break;
+
+		case 'V':
+			volume = 1;
+			break;
+
+		case 'L':
+			mask_below = _ttoi(optarg);
+			break;
+
+		case 'O':
+			mask_fill = _ttof(optarg);
+			break;
+
+		case 'w':
+			warm_start = _ttof(optarg);
+			break;
+
+		case 'I':
+			slice_warm_start = _ttof(optarg);
+			break;
+
+		case 'Y':
+			stream_rows = (uint32_t)_ttoi(optarg);
+			break;
+
 		default:
 			std::cout << "Unknown argument: " << (char)g << std::endl;
 			help(argv[0]);
@@ -307,10 +1345,31 @@ int _tmain(int argc, TCHAR *argv[])
 		return 0;
 	}
 
+	/* Streaming never holds a whole frame, or a whole slice to start the
+		next from */
+	if (stream_rows && (volume || pipelined || slice_warm_start > 0.0))
+	{
+		std::cerr << "ERROR: -Y cannot be used with -V, -P or -I" << std::endl;
+		return 0;
+	}
+
+	if (dect_algo < 0 || dect_algo >= dect_getDeviceCount())
+	{
+		std::cerr << "ERROR: Unknown device" << std::endl;
+		return 0;
+	}
+
+	if (compare_device < -1 || compare_device >= dect_getDeviceCount())
+	{
+		std::cerr << "ERROR: Unknown comparison device" << std::endl;
+		return 0;
+	}
+
 	if (reconstitute)
 	{
-		auto af = TIFFOpen(ascii(afname), "w");
-		auto bf = TIFFOpen(ascii(bfname), "w");
+		/* When validating A and B are the originals to compare against */
+		auto af = TIFFOpen(ascii(afname), validate ? "r" : "w");
+		auto bf = TIFFOpen(ascii(bfname), validate ? "r" : "w");
 
 		auto cf = TIFFOpen(ascii(xfname), "r");
 		auto df = TIFFOpen(ascii(yfname), "r");
@@ -322,14 +1381,22 @@ int _tmain(int argc, TCHAR *argv[])
 		assert(df);
 		assert(ef);
 
+		auto rtype = outputType(cf);
+		auto rctx = dect_createContext();
+		dect_contextSetOption(rctx, libdect_option::max_threads, max_threads);
+		dect_contextInitDevice(rctx, dect_algo, enhanced, use_single_fp,
+			rtype);
+
 		size_t c_len, d_len, e_len;
+		int frame_id = 0;
+		double sum_sq_a = 0.0, sum_sq_b = 0.0;
+		size_t total_pix = 0;
 
 		do
-
 		{
-			auto c = readTIFFDirectory2(cf, &c_len);
-			auto d = readTIFFDirectory2(df, &d_len);
-			auto e = readTIFFDirectory2(ef, &e_len);
+			auto c = readTIFFDirectory2(cf, rtype, &c_len);
+			auto d = readTIFFDirectory2(df, rtype, &d_len);
+			auto e = readTIFFDirectory2(ef, rtype, &e_len);
 
 			assert(c);
 			assert(d);
@@ -340,112 +1407,138 @@ int _tmain(int argc, TCHAR *argv[])
 			int16_t *a = (int16_t *)malloc(c_len * 2);
 			int16_t *b = (int16_t *)malloc(c_len * 2);
 
-			dect_reconstitute(c, d, e,
+			int16_t *orig_a = NULL, *orig_b = NULL;
+			if (validate)
+			{
+				size_t a_len, b_len;
+				orig_a = readTIFFDirectory(af, &a_len);
+				orig_b = readTIFFDirectory(bf, &b_len);
+				assert(a_len == c_len);
+				assert(b_len == c_len);
+			}
+
+			double rms_a = 0.0, rms_b = 0.0;
+			dect_contextReconstitute(rctx, c, d, e,
 				alphaa, betaa, gammaa,
 				alphab, betab, gammab,
 				a, b, c_len,
-				do_rotate ? ((int)c_len - 1) : 0);
-
-			// attempt to write something out
-			uint32_t iw, il, rps;
-			uint16_t o, comp;
-			uint16_t spp = 1;
-			uint16_t bps = 16;
-			uint16_t pc = PLANARCONFIG_CONTIG;
-			uint16_t ru, ph;
-			float xp = 0.0f, yp = 0.0f, xr, yr;
-			int ret;
-			ret = TIFFGetField(cf, TIFFTAG_IMAGEWIDTH, &iw);
-			assert(ret == 1);
-			ret = TIFFGetField(cf, TIFFTAG_IMAGELENGTH, &il);
-			assert(ret == 1);
-			ret = TIFFGetField(cf, TIFFTAG_ORIENTATION, &o);
-			assert(ret == 1);
-			ret = TIFFGetField(cf, TIFFTAG_ROWSPERSTRIP, &rps);
-			assert(ret == 1);
-			ret = TIFFGetField(cf, TIFFTAG_COMPRESSION, &comp);
-			assert(ret == 1);
-			ret = TIFFGetField(cf, TIFFTAG_RESOLUTIONUNIT, &ru);
-			assert(ret == 1);
-			ret = TIFFGetField(cf, TIFFTAG_PHOTOMETRIC, &ph);
-			assert(ret == 1);
-			if (TIFFGetField(cf, TIFFTAG_XPOSITION, &xp) != 1)
-				xp = 0;
-			if (TIFFGetField(cf, TIFFTAG_YPOSITION, &yp) != 1)
-				yp = 0;
-			ret = TIFFGetField(cf, TIFFTAG_XRESOLUTION, &xr);
-			assert(ret == 1);
-			ret = TIFFGetField(cf, TIFFTAG_YRESOLUTION, &yr);
-			assert(ret == 1);
-
-
-			ret = TIFFSetField(af, TIFFTAG_IMAGEWIDTH, iw);
-			assert(ret == 1);
-			ret = TIFFSetField(af, TIFFTAG_IMAGELENGTH, il);
-			assert(ret == 1);
-			ret = TIFFSetField(af, TIFFTAG_SAMPLESPERPIXEL, spp);
-			assert(ret == 1);
-			ret = TIFFSetField(af, TIFFTAG_BITSPERSAMPLE, bps);
-			assert(ret == 1);
-			ret = TIFFSetField(af, TIFFTAG_ORIENTATION, o);
-			assert(ret == 1);
-			ret = TIFFSetField(af, TIFFTAG_PLANARCONFIG, pc);
-			assert(ret == 1);
-			//ret = TIFFSetField(af, TIFFTAG_ROWSPERSTRIP, rps);
-			//assert(ret == 1);
-			ret = TIFFSetField(af, TIFFTAG_COMPRESSION, comp);
-			assert(ret == 1);
-			ret = TIFFSetField(af, TIFFTAG_RESOLUTIONUNIT, ru);
-			assert(ret == 1);
-			ret = TIFFSetField(af, TIFFTAG_PHOTOMETRIC, ph);
-			assert(ret == 1);
-			ret = TIFFSetField(af, TIFFTAG_XPOSITION, xp);
-			assert(ret == 1);
-			ret = TIFFSetField(af, TIFFTAG_YPOSITION, yp);
-			assert(ret == 1);
-			ret = TIFFSetField(af, TIFFTAG_XRESOLUTION, xr);
-			assert(ret == 1);
-			ret = TIFFSetField(af, TIFFTAG_YRESOLUTION, yr);
-			assert(ret == 1);
-			ret = TIFFSetField(af, TIFFTAG_SAMPLEFORMAT, 2);
-			assert(ret == 1);
-
-			ret = TIFFSetField(bf, TIFFTAG_IMAGEWIDTH, iw);
-			assert(ret == 1);
-			ret = TIFFSetField(bf, TIFFTAG_IMAGELENGTH, il);
-			assert(ret == 1);
-			ret = TIFFSetField(bf, TIFFTAG_SAMPLESPERPIXEL, spp);
-			assert(ret == 1);
-			ret = TIFFSetField(bf, TIFFTAG_BITSPERSAMPLE, bps);
-			assert(ret == 1);
-			ret = TIFFSetField(bf, TIFFTAG_ORIENTATION, o);
-			assert(ret == 1);
-			ret = TIFFSetField(bf, TIFFTAG_PLANARCONFIG, pc);
-			assert(ret == 1);
-			//ret = TIFFSetField(bf, TIFFTAG_ROWSPERSTRIP, rps);
-			//assert(ret == 1);
-			ret = TIFFSetField(bf, TIFFTAG_COMPRESSION, comp);
-			assert(ret == 1);
-			ret = TIFFSetField(bf, TIFFTAG_RESOLUTIONUNIT, ru);
-			assert(ret == 1);
-			ret = TIFFSetField(bf, TIFFTAG_PHOTOMETRIC, ph);
-			assert(ret == 1);
-			ret = TIFFSetField(bf, TIFFTAG_XPOSITION, xp);
-			assert(ret == 1);
-			ret = TIFFSetField(bf, TIFFTAG_YPOSITION, yp);
-			assert(ret == 1);
-			ret = TIFFSetField(bf, TIFFTAG_XRESOLUTION, xr);
-			assert(ret == 1);
-			ret = TIFFSetField(bf, TIFFTAG_YRESOLUTION, yr);
-			assert(ret == 1);
-			ret = TIFFSetField(bf, TIFFTAG_SAMPLEFORMAT, 2);
-			assert(ret == 1);
-
-			TIFFWriteEncodedStrip(af, 0, a, (tsize_t)c_len * 2);
-			TIFFWriteDirectory(af);
-
-			TIFFWriteEncodedStrip(bf, 0, b, (tsize_t)c_len * 2);
-			TIFFWriteDirectory(bf);
+				do_rotate ? ((int)c_len - 1) : 0,
+				orig_a, orig_b, &rms_a, &rms_b);
+
+			if (validate)
+			{
+				printf("Frame %i: RMS difference A %.3f HU, B %.3f HU\n",
+					frame_id, rms_a, rms_b);
+				sum_sq_a += rms_a * rms_a * (double)c_len;
+				sum_sq_b += rms_b * rms_b * (double)c_len;
+				total_pix += c_len;
+
+				_TIFFfree(orig_a);
+				_TIFFfree(orig_b);
+			}
+			else
+			{
+				// attempt to write something out
+				uint32_t iw, il, rps;
+				uint16_t o, comp;
+				uint16_t spp = 1;
+				uint16_t bps = 16;
+				uint16_t pc = PLANARCONFIG_CONTIG;
+				uint16_t ru, ph;
+				float xp = 0.0f, yp = 0.0f, xr, yr;
+				int ret;
+				ret = TIFFGetField(cf, TIFFTAG_IMAGEWIDTH, &iw);
+				assert(ret == 1);
+				ret = TIFFGetField(cf, TIFFTAG_IMAGELENGTH, &il);
+				assert(ret == 1);
+				ret = TIFFGetField(cf, TIFFTAG_ORIENTATION, &o);
+				assert(ret == 1);
+				ret = TIFFGetField(cf, TIFFTAG_ROWSPERSTRIP, &rps);
+				assert(ret == 1);
+				ret = TIFFGetField(cf, TIFFTAG_COMPRESSION, &comp);
+				assert(ret == 1);
+				ret = TIFFGetField(cf, TIFFTAG_RESOLUTIONUNIT, &ru);
+				assert(ret == 1);
+				ret = TIFFGetField(cf, TIFFTAG_PHOTOMETRIC, &ph);
+				assert(ret == 1);
+				if (TIFFGetField(cf, TIFFTAG_XPOSITION, &xp) != 1)
+					xp = 0;
+				if (TIFFGetField(cf, TIFFTAG_YPOSITION, &yp) != 1)
+					yp = 0;
+				ret = TIFFGetField(cf, TIFFTAG_XRESOLUTION, &xr);
+				assert(ret == 1);
+				ret = TIFFGetField(cf, TIFFTAG_YRESOLUTION, &yr);
+				assert(ret == 1);
+
+
+				ret = TIFFSetField(af, TIFFTAG_IMAGEWIDTH, iw);
+				assert(ret == 1);
+				ret = TIFFSetField(af, TIFFTAG_IMAGELENGTH, il);
+				assert(ret == 1);
+				ret = TIFFSetField(af, TIFFTAG_SAMPLESPERPIXEL, spp);
+				assert(ret == 1);
+				ret = TIFFSetField(af, TIFFTAG_BITSPERSAMPLE, bps);
+				assert(ret == 1);
+				ret = TIFFSetField(af, TIFFTAG_ORIENTATION, o);
+				assert(ret == 1);
+				ret = TIFFSetField(af, TIFFTAG_PLANARCONFIG, pc);
+				assert(ret == 1);
+				//ret = TIFFSetField(af, TIFFTAG_ROWSPERSTRIP, rps);
+				//assert(ret == 1);
+				ret = TIFFSetField(af, TIFFTAG_COMPRESSION, comp);
+				assert(ret == 1);
+				ret = TIFFSetField(af, TIFFTAG_RESOLUTIONUNIT, ru);
+				assert(ret == 1);
+				ret = TIFFSetField(af, TIFFTAG_PHOTOMETRIC, ph);
+				assert(ret == 1);
+				ret = TIFFSetField(af, TIFFTAG_XPOSITION, xp);
+				assert(ret == 1);
+				ret = TIFFSetField(af, TIFFTAG_YPOSITION, yp);
+				assert(ret == 1);
+				ret = TIFFSetField(af, TIFFTAG_XRESOLUTION, xr);
+				assert(ret == 1);
+				ret = TIFFSetField(af, TIFFTAG_YRESOLUTION, yr);
+				assert(ret == 1);
+				ret = TIFFSetField(af, TIFFTAG_SAMPLEFORMAT, 2);
+				assert(ret == 1);
+
+				ret = TIFFSetField(bf, TIFFTAG_IMAGEWIDTH, iw);
+				assert(ret == 1);
+				ret = TIFFSetField(bf, TIFFTAG_IMAGELENGTH, il);
+				assert(ret == 1);
+				ret = TIFFSetField(bf, TIFFTAG_SAMPLESPERPIXEL, spp);
+				assert(ret == 1);
+				ret = TIFFSetField(bf, TIFFTAG_BITSPERSAMPLE, bps);
+				assert(ret == 1);
+				ret = TIFFSetField(bf, TIFFTAG_ORIENTATION, o);
+				assert(ret == 1);
+				ret = TIFFSetField(bf, TIFFTAG_PLANARCONFIG, pc);
+				assert(ret == 1);
+				//ret = TIFFSetField(bf, TIFFTAG_ROWSPERSTRIP, rps);
+				//assert(ret == 1);
+				ret = TIFFSetField(bf, TIFFTAG_COMPRESSION, comp);
+				assert(ret == 1);
+				ret = TIFFSetField(bf, TIFFTAG_RESOLUTIONUNIT, ru);
+				assert(ret == 1);
+				ret = TIFFSetField(bf, TIFFTAG_PHOTOMETRIC, ph);
+				assert(ret == 1);
+				ret = TIFFSetField(bf, TIFFTAG_XPOSITION, xp);
+				assert(ret == 1);
+				ret = TIFFSetField(bf, TIFFTAG_YPOSITION, yp);
+				assert(ret == 1);
+				ret = TIFFSetField(bf, TIFFTAG_XRESOLUTION, xr);
+				assert(ret == 1);
+				ret = TIFFSetField(bf, TIFFTAG_YRESOLUTION, yr);
+				assert(ret == 1);
+				ret = TIFFSetField(bf, TIFFTAG_SAMPLEFORMAT, 2);
+				assert(ret == 1);
+
+				TIFFWriteEncodedStrip(af, 0, a, (tsize_t)c_len * 2);
+				TIFFWriteDirectory(af);
+
+				TIFFWriteEncodedStrip(bf, 0, b, (tsize_t)c_len * 2);
+				TIFFWriteDirectory(bf);
+			}
 
 			_TIFFfree(c);
 			_TIFFfree(d);
@@ -453,11 +1546,22 @@ int _tmain(int argc, TCHAR *argv[])
 
 			free(a);
 			free(b);
-		} while (TIFFReadDirectory(cf) && TIFFReadDirectory(df) && TIFFReadDirectory(ef));
+			frame_id++;
+		} while (TIFFReadDirectory(cf) && TIFFReadDirectory(df) && TIFFReadDirectory(ef) &&
+			(!validate || (TIFFReadDirectory(af) && TIFFReadDirectory(bf))));
 
-		TIFFFlush(af);
+		dect_destroyContext(rctx);
+
+		if (validate && total_pix)
+			printf("All frames: RMS difference A %.3f HU, B %.3f HU\n",
+				sqrt(sum_sq_a / (double)total_pix), sqrt(sum_sq_b / (double)total_pix));
+
+		if (!validate)
+		{
+			TIFFFlush(af);
+			TIFFFlush(bf);
+		}
 		TIFFClose(af);
-		TIFFFlush(bf);
 		TIFFClose(bf);
 
 		TIFFClose(cf);
@@ -483,262 +1587,123 @@ int _tmain(int argc, TCHAR *argv[])
 		assert(df);
 		assert(ef);
 
-		int frame_id = 0;
+		input_map amap, bmap;
+		mapInput(af, &amap);
+		mapInput(bf, &bmap);
 
+		dect_setOption(libdect_option::specialize, specialize);
 		dect_initDevice(dect_algo, enhanced, use_single_fp,
 			otype);
-
-		do
+		dect_setOption(libdect_option::dedup_pairs, dedup_pairs);
+		dect_setOption(libdect_option::hybrid, hybrid);
+		dect_setOption(libdect_option::max_threads, max_threads);
+		dect_setOption(libdect_option::mask_below, mask_below);
+		dect_setOption(libdect_option::mask_fill, mask_fill);
+		dect_setOption(libdect_option::warm_start, warm_start);
+		dect_setOption(libdect_option::slice_warm_start, slice_warm_start);
+		dect_setOption(libdect_option::simul, simul);
+		dect_setOption(libdect_option::lookup_table, use_lut);
+		dect_setOption(libdect_option::exact, use_exact);
+
+		/* Compare against the plain algorithm of the other device, with
+			the same mask */
+		if (compare_device >= 0)
 		{
-			auto a = readTIFFDirectory(af, &a_len);
-			auto b = readTIFFDirectory(bf, &b_len);
-
-			assert(a);
-			assert(b);
-			assert(a_len == b_len);
+			compare_ctx = dect_createContext();
+			dect_contextSetOption(compare_ctx, libdect_option::dedup_pairs, dedup_pairs);
+			dect_contextSetOption(compare_ctx, libdect_option::max_threads, max_threads);
+			dect_contextSetOption(compare_ctx, libdect_option::mask_below, mask_below);
+			dect_contextSetOption(compare_ctx, libdect_option::mask_fill, mask_fill);
+			if (dect_contextInitDevice(compare_ctx, compare_device, enhanced,
+				use_single_fp, otype) != 0)
+			{
+				std::cerr << "ERROR: Comparison device is not available" << std::endl;
+				return 0;
+			}
+		}
 
-			auto out_size = a_len;
+		if (volume)
+		{
+			std::vector<frame *> frames;
+			int frame_id = 0;
 
-			switch (otype)
+			do
 			{
-			case libdect_output_type::u16:
-				out_size *= 2;
-				break;
-			case libdect_output_type::f32:
-				out_size *= 4;
-				break;
-			case libdect_output_type::f64:
-				out_size *= 8;
-				break;
-			}
+				frames.push_back(readFrame(&amap, &bmap, frame_id++, otype, mf != NULL));
+			} while (TIFFReadDirectory(af) && TIFFReadDirectory(bf));
 
-			void *x = malloc(out_size);
-			void *y = malloc(out_size);
-			void *z = malloc(out_size);
+			processVolume(frames, compare_device, otype, do_rotate);
 
-			int16_t *m = NULL;
-			if (mf)
-				m = (int16_t *)malloc(a_len * 2);
+			for (auto it = frames.begin(); it < frames.end(); it++)
+				writeFrame(*it, cf, df, ef, mf, otype);
+		}
+		else if (stream_rows)
+		{
+			int frame_id = 0;
 
-			// run the algorithm
-			auto algo_ret = dect_process(
-				dect_algo, enhanced,
-				a, b, alphaa, betaa, gammaa,
-				alphab, betab, gammab,
-				x, y, z, a_len, min_step, m, merge_fact,
-				do_rotate ? ((int)a_len - 1) : 0);
-			if (algo_ret != 0)
+			do
 			{
-				std::cerr << "ERROR: DECT algorithm failed" << std::endl;
-				exit(0);
-			}
-
-			// attempt to write something out
-			int ret;
-			uint16_t bps = 8;
-			int sf = 1;
-			switch (otype)
+				streamFrame(&amap, &bmap, frame_id++, cf, df, ef, mf, otype,
+					compare_device, do_rotate, stream_rows);
+			} while (TIFFReadDirectory(af) && TIFFReadDirectory(bf));
+		}
+		else if (pipelined)
+		{
+			/* Frame n + 1 is read and frame n - 1 is written while
+				frame n is processed on this thread */
+			frame_queue read_q(PIPELINE_DEPTH), write_q(PIPELINE_DEPTH);
+
+			std::thread reader([&] {
+				int frame_id = 0;
+				do
+				{
+					read_q.push(readFrame(&amap, &bmap, frame_id++, otype, mf != NULL));
+				} while (TIFFReadDirectory(af) && TIFFReadDirectory(bf));
+				read_q.close();
+			});
+
+			std::thread writer([&] {
+				frame *f;
+				while ((f = write_q.pop()) != NULL)
+					writeFrame(f, cf, df, ef, mf, otype);
+			});
+
+			/* Frame n is queued on the device before frame n - 1 is
+				waited for, so that the device is kept busy */
+			frame *f, *prev = NULL;
+			libdect_job *prev_job = NULL;
+			while ((f = read_q.pop()) != NULL)
 			{
-			case libdect_output_type::u16:
-				bps = 16;
-				break;
-			case libdect_output_type::f32:
-				bps = 32;
-				sf = 3;
-				break;
-			case libdect_output_type::f64:
-				bps = 64;
-				sf = 3;
-				break;
+				auto job = submitFrame(f, do_rotate);
+				if (prev)
+				{
+					finishFrame(prev, prev_job, compare_device, otype, do_rotate);
+					write_q.push(prev);
+				}
+				prev = f;
+				prev_job = job;
 			}
-			uint32_t iw, il, rps;
-			uint16_t o = ORIENTATION_TOPLEFT, comp = COMPRESSION_LZW;
-			uint16_t spp = 1;
-			uint16_t pc = PLANARCONFIG_CONTIG;
-			uint16_t ru, ph;
-			float xp = 0.0f, yp = 0.0f, xr, yr;
-			ret = TIFFGetField(af, TIFFTAG_IMAGEWIDTH, &iw);
-			assert(ret == 1);
-			ret = TIFFGetField(af, TIFFTAG_IMAGELENGTH, &il);
-			assert(ret == 1);
-			ret = TIFFGetField(af, TIFFTAG_ORIENTATION, &o);
-			//assert(ret == 1);
-			ret = TIFFGetField(af, TIFFTAG_ROWSPERSTRIP, &rps);
-			assert(ret == 1);
-			//ret = TIFFGetField(af, TIFFTAG_COMPRESSION, &comp);
-			//assert(ret == 1);
-			ret = TIFFGetField(af, TIFFTAG_RESOLUTIONUNIT, &ru);
-			assert(ret == 1);
-			ret = TIFFGetField(af, TIFFTAG_PHOTOMETRIC, &ph);
-			assert(ret == 1);
-			if (TIFFGetField(af, TIFFTAG_XPOSITION, &xp) != 1)
-				xp = 0;
-			if (TIFFGetField(af, TIFFTAG_YPOSITION, &yp) != 1)
-				yp = 0;
-			ret = TIFFGetField(af, TIFFTAG_XRESOLUTION, &xr);
-			assert(ret == 1);
-			ret = TIFFGetField(af, TIFFTAG_YRESOLUTION, &yr);
-			assert(ret == 1);
-
-
-			ret = TIFFSetField(cf, TIFFTAG_IMAGEWIDTH, iw);
-			assert(ret == 1);
-			ret = TIFFSetField(cf, TIFFTAG_IMAGELENGTH, il);
-			assert(ret == 1);
-			ret = TIFFSetField(cf, TIFFTAG_SAMPLESPERPIXEL, spp);
-			assert(ret == 1);
-			ret = TIFFSetField(cf, TIFFTAG_BITSPERSAMPLE, bps);
-			assert(ret == 1);
-			ret = TIFFSetField(cf, TIFFTAG_ORIENTATION, o);
-			assert(ret == 1);
-			ret = TIFFSetField(cf, TIFFTAG_PLANARCONFIG, pc);
-			assert(ret == 1);
-			//ret = TIFFSetField(cf, TIFFTAG_ROWSPERSTRIP, rps);
-			//assert(ret == 1);
-			ret = TIFFSetField(cf, TIFFTAG_COMPRESSION, comp);
-			assert(ret == 1);
-			ret = TIFFSetField(cf, TIFFTAG_RESOLUTIONUNIT, ru);
-			assert(ret == 1);
-			ret = TIFFSetField(cf, TIFFTAG_PHOTOMETRIC, ph);
-			assert(ret == 1);
-			ret = TIFFSetField(cf, TIFFTAG_XPOSITION, xp);
-			assert(ret == 1);
-			ret = TIFFSetField(cf, TIFFTAG_YPOSITION, yp);
-			assert(ret == 1);
-			ret = TIFFSetField(cf, TIFFTAG_XRESOLUTION, xr);
-			assert(ret == 1);
-			ret = TIFFSetField(cf, TIFFTAG_YRESOLUTION, yr);
-			assert(ret == 1);
-			ret = TIFFSetField(cf, TIFFTAG_SAMPLEFORMAT, sf);
-			assert(ret == 1);
-
-			ret = TIFFSetField(df, TIFFTAG_IMAGEWIDTH, iw);
-			assert(ret == 1);
-			ret = TIFFSetField(df, TIFFTAG_IMAGELENGTH, il);
-			assert(ret == 1);
-			ret = TIFFSetField(df, TIFFTAG_SAMPLESPERPIXEL, spp);
-			assert(ret == 1);
-			ret = TIFFSetField(df, TIFFTAG_BITSPERSAMPLE, bps);
-			assert(ret == 1);
-			ret = TIFFSetField(df, TIFFTAG_ORIENTATION, o);
-			assert(ret == 1);
-			ret = TIFFSetField(df, TIFFTAG_PLANARCONFIG, pc);
-			assert(ret == 1);
-			//ret = TIFFSetField(df, TIFFTAG_ROWSPERSTRIP, rps);
-			//assert(ret == 1);
-			ret = TIFFSetField(df, TIFFTAG_COMPRESSION, comp);
-			assert(ret == 1);
-			ret = TIFFSetField(df, TIFFTAG_RESOLUTIONUNIT, ru);
-			assert(ret == 1);
-			ret = TIFFSetField(df, TIFFTAG_PHOTOMETRIC, ph);
-			assert(ret == 1);
-			ret = TIFFSetField(df, TIFFTAG_XPOSITION, xp);
-			assert(ret == 1);
-			ret = TIFFSetField(df, TIFFTAG_YPOSITION, yp);
-			assert(ret == 1);
-			ret = TIFFSetField(df, TIFFTAG_XRESOLUTION, xr);
-			assert(ret == 1);
-			ret = TIFFSetField(df, TIFFTAG_YRESOLUTION, yr);
-			assert(ret == 1);
-			ret = TIFFSetField(df, TIFFTAG_SAMPLEFORMAT, sf);
-			assert(ret == 1);
-
-			ret = TIFFSetField(ef, TIFFTAG_IMAGEWIDTH, iw);
-			assert(ret == 1);
-			ret = TIFFSetField(ef, TIFFTAG_IMAGELENGTH, il);
-			assert(ret == 1);
-			ret = TIFFSetField(ef, TIFFTAG_SAMPLESPERPIXEL, spp);
-			assert(ret == 1);
-			ret = TIFFSetField(ef, TIFFTAG_BITSPERSAMPLE, bps);
-			assert(ret == 1);
-			ret = TIFFSetField(ef, TIFFTAG_ORIENTATION, o);
-			assert(ret == 1);
-			ret = TIFFSetField(ef, TIFFTAG_PLANARCONFIG, pc);
-			assert(ret == 1);
-			//ret = TIFFSetField(ef, TIFFTAG_ROWSPERSTRIP, rps);
-			//assert(ret == 1);
-			ret = TIFFSetField(ef, TIFFTAG_COMPRESSION, comp);
-			assert(ret == 1);
-			ret = TIFFSetField(ef, TIFFTAG_RESOLUTIONUNIT, ru);
-			assert(ret == 1);
-			ret = TIFFSetField(ef, TIFFTAG_PHOTOMETRIC, ph);
-			assert(ret == 1);
-			ret = TIFFSetField(ef, TIFFTAG_XPOSITION, xp);
-			assert(ret == 1);
-			ret = TIFFSetField(ef, TIFFTAG_YPOSITION, yp);
-			assert(ret == 1);
-			ret = TIFFSetField(ef, TIFFTAG_XRESOLUTION, xr);
-			assert(ret == 1);
-			ret = TIFFSetField(ef, TIFFTAG_YRESOLUTION, yr);
-			assert(ret == 1);
-			ret = TIFFSetField(ef, TIFFTAG_SAMPLEFORMAT, sf);
-			assert(ret == 1);
-
-			TIFFWriteEncodedStrip(cf, 0, x, (tsize_t)out_size);
-			TIFFWriteDirectory(cf);
-
-			TIFFWriteEncodedStrip(df, 0, y, (tsize_t)out_size);
-			TIFFWriteDirectory(df);
-
-			TIFFWriteEncodedStrip(ef, 0, z, (tsize_t)out_size);
-			TIFFWriteDirectory(ef);
-
-			_TIFFfree(a);
-			_TIFFfree(b);
-
-			free(x);
-			free(y);
-			free(z);
-
-			if (m)
+			if (prev)
 			{
-				ret = TIFFSetField(mf, TIFFTAG_IMAGEWIDTH, iw);
-				assert(ret == 1);
-				ret = TIFFSetField(mf, TIFFTAG_IMAGELENGTH, il);
-				assert(ret == 1);
-				ret = TIFFSetField(mf, TIFFTAG_SAMPLESPERPIXEL, 1);
-				assert(ret == 1);
-				ret = TIFFSetField(mf, TIFFTAG_BITSPERSAMPLE, 16);
-				assert(ret == 1);
-				ret = TIFFSetField(mf, TIFFTAG_ORIENTATION, o);
-				assert(ret == 1);
-				ret = TIFFSetField(mf, TIFFTAG_PLANARCONFIG, pc);
-				assert(ret == 1);
-				ret = TIFFSetField(mf, TIFFTAG_ROWSPERSTRIP, rps);
-				assert(ret == 1);
-				ret = TIFFSetField(mf, TIFFTAG_COMPRESSION, comp);
-				assert(ret == 1);
-				ret = TIFFSetField(mf, TIFFTAG_RESOLUTIONUNIT, ru);
-				assert(ret == 1);
-				ret = TIFFSetField(mf, TIFFTAG_PHOTOMETRIC, ph);
-				assert(ret == 1);
-				ret = TIFFSetField(mf, TIFFTAG_XPOSITION, xp);
-				assert(ret == 1);
-				ret = TIFFSetField(mf, TIFFTAG_YPOSITION, yp);
-				assert(ret == 1);
-				ret = TIFFSetField(mf, TIFFTAG_XRESOLUTION, xr);
-				assert(ret == 1);
-				ret = TIFFSetField(mf, TIFFTAG_YRESOLUTION, yr);
-				assert(ret == 1);
-				ret = TIFFSetField(mf, TIFFTAG_SAMPLEFORMAT, 2);
-				assert(ret == 1);
-
-				TIFFWriteEncodedStrip(mf, 0, m, (tsize_t)a_len * 2);
-				TIFFWriteDirectory(mf);
-
-				free(m);
+				finishFrame(prev, prev_job, compare_device, otype, do_rotate);
+				write_q.push(prev);
 			}
+			write_q.close();
 
-			switch (quiet)
+			reader.join();
+			writer.join();
+		}
+		else
+		{
+			int frame_id = 0;
+
+			do
 			{
-			case 0:
-				printf("Processed frame %i\n", frame_id++);
-				break;
-			case 2:
-				printf(".\n");
-				break;
-			}
-		} while (TIFFReadDirectory(af) && TIFFReadDirectory(bf));
+				auto f = readFrame(&amap, &bmap, frame_id++, otype, mf != NULL);
+				processFrame(f, compare_device, otype, do_rotate);
+				writeFrame(f, cf, df, ef, mf, otype);
+			} while (TIFFReadDirectory(af) && TIFFReadDirectory(bf));
+		}
 
 		TIFFFlush(cf);
 		TIFFClose(cf);
@@ -753,8 +1718,13 @@ int _tmain(int argc, TCHAR *argv[])
 			TIFFClose(mf);
 		}
 
+		unmapInput(&amap);
+		unmapInput(&bmap);
 		TIFFClose(af);
 		TIFFClose(bf);
+
+		if (compare_ctx)
+			dect_destroyContext(compare_ctx);
 	}
 
 	return 0;
@@ -0,0 +1,52 @@
+/* Copyright (C) 2016-2020 by John Cronin
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+
+#include <stdint.h>
+#include <iostream>
+
+#define IN_LIBDECT
+#include "libdect.h"
+#include "cpu.h"
+
+/* The search itself is in cpu_template.h, instantiated for each floating
+point and output type by its own cpu*.cpp file */
+
+int dect_algo_cpu_iter(const cpu_iter_params *p)
+{
+	if (p->enhanced < 1 || p->enhanced > 3)
+	{
+		std::cerr << "ERROR: Invalid enhanced mode " << p->enhanced << std::endl;
+		return -1;
+	}
+
+	cpu_run_func func = NULL;
+	cpu_type_dispatch(p->use_single_fp, p->otype, [&](auto *fp, auto *ot) {
+		typedef std::remove_pointer_t<decltype(fp)> FP;
+		typedef std::remove_pointer_t<decltype(ot)> OT;
+		func = dect_algo_cpu_select<FP, OT>(p->enhanced, p->idx_adjust);
+	});
+
+	if (!func)
+		return -1;
+
+	return func(p);
+}
@@ -0,0 +1,206 @@
+/* Copyright (C) 2016-2020 by John Cronin
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+
+/* The CPU search, as the CPU device options and the other CPU algorithms
+use it */
+
+#pragma once
+
+#ifndef CPU_H
+#define CPU_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <math.h>
+#include <algorithm>
+#include <type_traits>
+#include <vector>
+#include "libdect.h"
+
+/* Bytes in each voxel of x, y and z */
+static inline size_t otype_size(libdect_output_type otype)
+{
+	switch (otype)
+	{
+	case libdect_output_type::u16:
+		return 2;
+	case libdect_output_type::f32:
+		return 4;
+	case libdect_output_type::f64:
+		return 8;
+	default:
+		return 1;
+	}
+}
+
+/* Call f with null pointers of the floating point type the search
+uses and of the C type of otype, for code which is templated on them.
+Code which makes the merged image beside the search makes it in the same
+precision, so that it matches the plain cpu algorithm. */
+template <typename F> static inline int cpu_type_dispatch(int use_single_fp,
+	libdect_output_type otype, F &&f)
+{
+	auto with_fp = [&](auto *fp) {
+		switch (otype)
+		{
+		case libdect_output_type::u8:
+			f(fp, (uint8_t *)NULL);
+			return 0;
+		case libdect_output_type::u16:
+			f(fp, (uint16_t *)NULL);
+			return 0;
+		case libdect_output_type::f32:
+			f(fp, (float *)NULL);
+			return 0;
+		case libdect_output_type::f64:
+			f(fp, (double *)NULL);
+			return 0;
+		}
+		return -1;
+	};
+
+	if (use_single_fp)
+		return with_fp((float *)NULL);
+	else
+		return with_fp((double *)NULL);
+}
+
+/* Integer range that covers all distinct clamped values, as the search
+clamps the inputs to the range of the densities */
+static inline void clamped_range(float d0, float d1, float d2, int *lo, int *hi)
+{
+	float dmin = std::min(d0, std::min(d1, d2));
+	float dmax = std::max(d0, std::max(d1, d2));
+
+	*lo = std::clamp((int)floor(dmin), (int)INT16_MIN, (int)INT16_MAX);
+	*hi = std::clamp((int)ceil(dmax), (int)INT16_MIN, (int)INT16_MAX);
+}
+
+/* What dect_algo_cpu_iter solves, and how.  Every input is XORed with
+in_flip as it is read.  A NULL m skips the merged image, a nonzero
+idx_adjust rotates the output as in dect_process, and a non-NULL field
+holds the solutions slice_warm_start keeps between frames. */
+struct cpu_iter_params
+{
+	int enhanced = 1;
+	const int16_t *a = NULL, *b = NULL;
+	float alphaa = 0.0f, betaa = 0.0f, gammaa = 0.0f;
+	float alphab = 0.0f, betab = 0.0f, gammab = 0.0f;
+	void *x = NULL, *y = NULL, *z = NULL;
+	size_t pix_count = 0;
+	float min_step = 0.0f;
+	int16_t *m = NULL;
+	float mr = 0.0f;
+	int idx_adjust = 0;
+	int in_flip = 0;
+	int use_single_fp = 0;
+	libdect_output_type otype = libdect_output_type::u8;
+	int use_simd = 0;
+	int mask_below = INT16_MIN;
+	float mask_fill = 0.0f;
+	float warm_start = 0.0f;
+	float *field = NULL;
+	float field_start = 0.0f;
+};
+
+/* Voxels per block when packing a subset of a frame together, which
+are counted and then packed in parallel */
+#define COMPACT_BLOCK_PIX ((size_t)1 << 16)
+
+/* Where the voxels of each block for which keep(idx) is true start when
+they are packed together in frame order.  The last entry is how many
+there are. */
+template <typename KEEP> static std::vector<size_t> compact_starts(
+	size_t pix_count, KEEP &&keep)
+{
+	auto blocks = (pix_count + COMPACT_BLOCK_PIX - 1) / COMPACT_BLOCK_PIX;
+	std::vector<size_t> starts(blocks + 1, 0);
+
+#pragma omp parallel for
+	for (long long blk = 0; blk < (long long)blocks; blk++)
+	{
+		auto begin = (size_t)blk * COMPACT_BLOCK_PIX;
+		auto end = std::min(begin + COMPACT_BLOCK_PIX, pix_count);
+		size_t n = 0;
+		for (auto idx = begin; idx < end; idx++)
+			n += keep(idx) ? 1 : 0;
+		starts[blk + 1] = n;
+	}
+
+	for (size_t blk = 0; blk < blocks; blk++)
+		starts[blk + 1] += starts[blk];
+
+	return starts;
+}
+
+/* Call pack(idx, out) for each voxel for which keep(idx) is true, with
+its place out among them from compact_starts */
+template <typename KEEP, typename PACK> static void compact_pack(
+	size_t pix_count, const std::vector<size_t> &starts,
+	KEEP &&keep, PACK &&pack)
+{
+	auto blocks = starts.size() - 1;
+
+#pragma omp parallel for
+	for (long long blk = 0; blk < (long long)blocks; blk++)
+	{
+		auto begin = (size_t)blk * COMPACT_BLOCK_PIX;
+		auto end = std::min(begin + COMPACT_BLOCK_PIX, pix_count);
+		auto out = starts[blk];
+		for (auto idx = begin; idx < end; idx++)
+		{
+			if (keep(idx))
+				pack(idx, out++);
+		}
+	}
+}
+
+int dect_algo_cpu_iter(const cpu_iter_params *p);
+
+/* The search of each distinct clamped (a, b) pair once, from dedup.cpp */
+int dect_algo_dedup(int enhanced,
+	const int16_t *a, const int16_t *b,
+	float alphaa, float betaa, float gammaa,
+	float alphab, float betab, float gammab,
+	void *x, void *y, void *z,
+	size_t pix_count,
+	float min_step,
+	int16_t *m,
+	float mr,
+	int idx_adjust,
+	int use_single_fp,
+	libdect_output_type otype,
+	int use_simd,
+	float warm_start,
+	size_t *unique_pairs,
+	int in_flip);
+
+/* The search for one floating point type, output type, enhanced mode and
+rotation.  dect_algo_cpu_select is defined in cpu_template.h and
+explicitly instantiated for each pair of types, one line in the cpu*.cpp
+file for those types, and called through cpu_type_dispatch. */
+typedef int (*cpu_run_func)(const cpu_iter_params *p);
+
+template <typename FP, typename OT> cpu_run_func dect_algo_cpu_select(
+	int enhanced, int idx_adjust);
+
+#endif
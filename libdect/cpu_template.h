@@ -0,0 +1,1023 @@
+/* Copyright (C) 2016-2020 by John Cronin
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+/* The CPU search, shared by the cpu*.cpp files which each instantiate it
+for one floating point and output type */
+
+#pragma once
+
+#ifndef CPU_TEMPLATE_H
+#define CPU_TEMPLATE_H
+
+#include <stdint.h>
+#include <math.h>
+#include <stddef.h>
+#include <algorithm>
+#include <iostream>
+#include <type_traits>
+#include <utility>
+
+#define IN_LIBDECT
+#include "libdect.h"
+#include "cpu.h"
+
+#ifndef _MSC_VER
+#ifdef __GNUC__
+#define RESTRICT __restrict
+#define CPU_INLINE inline __attribute__((always_inline))
+#endif
+#else
+#define RESTRICT __restrict
+#define CPU_INLINE __forceinline
+#endif
+
+#ifndef CPU_INLINE
+#define CPU_INLINE inline
+#endif
+
+/* The cpu algorithm is written as templates over the floating point type
+used for the search (FP), the output type (OT), the number of permutations
+of the materials (ENHANCED, 1 to 3) and whether the output is rotated
+(ROTATE), so that each combination is compiled without any branches on
+them in the per-voxel code.  Each of the cpu*.cpp files instantiates
+them for one FP and OT, so that the instantiations build in parallel,
+and dect_algo_cpu_iter in cpu.cpp picks the one to use.
+
+Every input is XORed with in_flip as it is read.  It is INT16_MIN for
+unsigned inputs, which moves them into the signed range as the usual
+offset of 32768 would, and 0 otherwise. */
+
+/* Scale and rounding of each output type.  Integer outputs are the
+fraction of their range rounded down, floating point ones the fraction
+itself. */
+template <typename OT> struct cpu_output;
+
+template <> struct cpu_output<uint8_t>
+{
+	static constexpr double max = 255.0;
+};
+
+template <> struct cpu_output<uint16_t>
+{
+	static constexpr double max = 65535.0;
+};
+
+template <> struct cpu_output<float>
+{
+	static constexpr double max = 1.0;
+};
+
+template <> struct cpu_output<double>
+{
+	static constexpr double max = 1.0;
+};
+
+template <typename OT> static inline OT dect_algo_cpu_output(double v)
+{
+	if constexpr (std::is_integral<OT>::value)
+		return (OT)floor(v * cpu_output<OT>::max);
+	else
+		return (OT)v;
+}
+
+/* Squared error of the estimate at (new_ab, new_ratio) */
+template <typename FP> static inline FP dect_algo_cpu_err(FP new_ab, FP new_ratio,
+	FP dA, FP dB,
+	FP calphaa, FP cbetaa, FP cgammaa,
+	FP calphab, FP cbetab, FP cgammab)
+{
+	FP cur_a = new_ab * new_ratio;
+	FP cur_b = new_ab * (static_cast<FP>(1.0) - new_ratio);
+	FP cur_c = static_cast<FP>(1.0) - new_ab;
+
+	FP dA_est = calphaa * cur_a + cbetaa * cur_b + cgammaa * cur_c;
+	FP dB_est = calphab * cur_a + cbetab * cur_b + cgammab * cur_c;
+
+	FP dA_err = (dA_est - dA) * (dA_est - dA);
+	FP dB_err = (dB_est - dB) * (dB_est - dB);
+
+	return dA_err + dB_err;
+}
+
+/* Whether to start the iterative search from the (ab, ratio) in seed,
+which is negative if there is none, rather than from the coarse grid.
+Only if its error here, returned in err, is at most max_err. */
+template <typename FP> static inline bool dect_algo_cpu_seed(const float *seed,
+	FP max_err,
+	FP dA, FP dB,
+	FP calphaa, FP cbetaa, FP cgammaa,
+	FP calphab, FP cbetab, FP cgammab,
+	FP *err)
+{
+	if (!seed || seed[0] < 0.0f)
+		return false;
+
+	*err = dect_algo_cpu_err<FP>(seed[0], seed[1], dA, dB,
+		calphaa, cbetaa, cgammaa, calphab, cbetab, cgammab);
+	return *err <= max_err;
+}
+
+/* The densities of one image in the order of permutation PERM of the
+materials, see dect_algo_cpu */
+template <int PERM, typename FP> static CPU_INLINE void dect_algo_cpu_permute(
+	FP alpha, FP beta, FP gamma,
+	FP *calpha, FP *cbeta, FP *cgamma)
+{
+	if constexpr (PERM == 0)
+	{
+		*calpha = alpha;
+		*cbeta = beta;
+		*cgamma = gamma;
+	}
+	else if constexpr (PERM == 1)
+	{
+		*calpha = gamma;
+		*cbeta = alpha;
+		*cgamma = beta;
+	}
+	else
+	{
+		*calpha = beta;
+		*cbeta = gamma;
+		*cgamma = alpha;
+	}
+}
+
+/* Add the fractions at (ab, ratio) for permutation PERM to those of the
+materials in their original order */
+template <int PERM, typename FP> static CPU_INLINE void dect_algo_cpu_accumulate(
+	FP ab, FP ratio,
+	FP *tot_best_a, FP *tot_best_b, FP *tot_best_c)
+{
+	FP cur_p = ab * ratio;
+	FP cur_q = ab * (static_cast<FP>(1.0) - ratio);
+	FP cur_r = static_cast<FP>(1.0) - ab;
+
+	if constexpr (PERM == 0)
+	{
+		*tot_best_a += cur_p;
+		*tot_best_b += cur_q;
+		*tot_best_c += cur_r;
+	}
+	else if constexpr (PERM == 1)
+	{
+		*tot_best_c += cur_p;
+		*tot_best_a += cur_q;
+		*tot_best_b += cur_r;
+	}
+	else
+	{
+		*tot_best_b += cur_p;
+		*tot_best_c += cur_q;
+		*tot_best_a += cur_r;
+	}
+}
+
+template <bool ROTATE> static inline size_t dect_algo_cpu_out_idx(size_t idx,
+	int idx_adjust)
+{
+	if constexpr (ROTATE)
+		return (size_t)idx_adjust - idx;
+	else
+		return idx;
+}
+
+/* One permutation of the search in dect_algo_cpu.  warm and vfield point
+at the (ab, ratio) for this permutation. */
+template <typename FP, int PERM> static CPU_INLINE void dect_algo_cpu_perm(
+	FP dA, FP dB,
+	FP alphaa, FP betaa, FP gammaa,
+	FP alphab, FP betab, FP gammab,
+	FP min_step,
+	float * RESTRICT warm,
+	FP warm_err,
+	float * RESTRICT vfield,
+	FP field_err,
+	FP *tot_best_a, FP *tot_best_b, FP *tot_best_c)
+{
+	FP cur_ratio = static_cast<FP>(0.5);
+	FP cur_ab = static_cast<FP>(0.66);
+	FP cur_step = static_cast<FP>(0.25);
+	FP cur_error = static_cast<FP>(5000.0 * 5000.0);
+
+	FP calphaa, cbetaa, cgammaa;
+	FP calphab, cbetab, cgammab;
+	dect_algo_cpu_permute<PERM>(alphaa, betaa, gammaa, &calphaa, &cbetaa, &cgammaa);
+	dect_algo_cpu_permute<PERM>(alphab, betab, gammab, &calphab, &cbetab, &cgammab);
+
+	/* First, iterate through ratio and ab at 0.1 intervals
+	to ensure we don't miss an approximate solution, then
+	iterate to find the actual best value - this prevents us
+	finding islands of solutions which aren't necessarily the best
+	solutions */
+
+	FP best_err = 5000.0 * 5000.0;
+	FP best_ab = 0.0;
+	FP best_ratio = 0.0;
+
+	const float *seed = NULL;
+	FP seed_err;
+	if (vfield && dect_algo_cpu_seed<FP>(vfield, field_err, dA, dB,
+		calphaa, cbetaa, cgammaa, calphab, cbetab, cgammab, &seed_err))
+		seed = vfield;
+	else if (warm && dect_algo_cpu_seed<FP>(warm, warm_err, dA, dB,
+		calphaa, cbetaa, cgammaa, calphab, cbetab, cgammab, &seed_err))
+		seed = warm;
+
+	bool seeded = seed != NULL;
+	if (seeded)
+	{
+		best_ab = seed[0];
+		best_ratio = seed[1];
+		cur_error = seed_err;
+	}
+
+	for (FP test_ab = static_cast<FP>(0.0);
+		!seeded && test_ab <= static_cast<FP>(1.0); test_ab += static_cast<FP>(0.1))
+	{
+		for (FP test_ratio = static_cast<FP>(0.0);
+			test_ratio <= static_cast<FP>(1.0); test_ratio += static_cast<FP>(0.1))
+		{
+			FP cur_a = test_ab * test_ratio;
+			FP cur_b = test_ab * (static_cast<FP>(1.0) - test_ratio);
+			FP cur_c = static_cast<FP>(1.0) - cur_a - cur_b;
+
+			FP dA_est = calphaa * cur_a + cbetaa * cur_b + cgammaa * cur_c;
+			FP dB_est = calphab * cur_a + cbetab * cur_b + cgammab * cur_c;
+
+			FP dA_err = (dA_est - dA) * (dA_est - dA);
+			FP dB_err = (dB_est - dB) * (dB_est - dB);
+
+			FP tot_err = dA_err + dB_err;
+
+			if (tot_err < best_err)
+			{
+				best_err = tot_err;
+				best_ab = test_ab;
+				best_ratio = test_ratio;
+			}
+		}
+	}
+
+	/* Now do an iterative search to find the best values */
+	cur_step = static_cast<FP>(0.05);
+	cur_ratio = best_ratio;
+	cur_ab = best_ab;
+
+	while (cur_step >= min_step)
+	{
+		FP min_err;
+		FP min_ab;
+		FP min_ratio;
+
+		for (int j = 0; j < 4; j++)
+		{
+			FP new_ab, new_ratio;
+			switch (j)
+			{
+			case 0:
+				new_ab = cur_ab + cur_step;
+				new_ratio = cur_ratio;
+				break;
+			case 1:
+				new_ab = cur_ab;
+				new_ratio = cur_ratio + cur_step;
+				break;
+			case 2:
+				new_ab = cur_ab - cur_step;
+				new_ratio = cur_ratio;
+				break;
+			case 3:
+				new_ab = cur_ab;
+				new_ratio = cur_ratio - cur_step;
+				break;
+			}
+
+			if (new_ab < 0.0)
+				new_ab = 0.0;
+			if (new_ab > 1.0)
+				new_ab = 1.0;
+			if (new_ratio < 0.0)
+				new_ratio = 0.0;
+			if (new_ratio > 1.0)
+				new_ratio = 1.0;
+
+			FP cur_a = new_ab * new_ratio;
+			FP cur_b = new_ab * (static_cast<FP>(1.0) - new_ratio);
+			FP cur_c = static_cast<FP>(1.0) - new_ab;
+
+			FP dA_est = calphaa * cur_a + cbetaa * cur_b + cgammaa * cur_c;
+			FP dB_est = calphab * cur_a + cbetab * cur_b + cgammab * cur_c;
+
+			FP dA_err = (dA_est - dA) * (dA_est - dA);
+			FP dB_err = (dB_est - dB) * (dB_est - dB);
+
+			FP tot_err = dA_err + dB_err;
+
+			if (j == 0 || tot_err < min_err)
+			{
+				min_err = tot_err;
+				min_ratio = new_ratio;
+				min_ab = new_ab;
+			}
+		}
+
+		if (min_err < cur_error)
+		{
+			cur_ratio = min_ratio;
+			cur_ab = min_ab;
+			cur_error = min_err;
+		}
+		else
+		{
+			cur_step = cur_step / static_cast<FP>(2.0);
+		}
+	}
+
+	if (warm)
+	{
+		warm[0] = (float)cur_ab;
+		warm[1] = (float)cur_ratio;
+	}
+	if (vfield)
+	{
+		vfield[0] = (float)cur_ab;
+		vfield[1] = (float)cur_ratio;
+	}
+
+	dect_algo_cpu_accumulate<PERM>(cur_ab, cur_ratio,
+		tot_best_a, tot_best_b, tot_best_c);
+}
+
+/* Algorithm written with a view to parallelizing with OpenCL
+a, b			- input images
+alphaa, alphab	- CT density of material 1 in image a and b
+betaa, betab	- CT density of material 2 in image a and b
+gammaa, gammab	- CT density of material 3 in image a and b
+idx				- voxel number
+x, y, z			- output images
+min_step		- threshold below which to stop algorithm
+warm			- if not NULL, the (ab, ratio) of the previous voxel for each
+				  permutation, or negative if there is none, replaced by
+				  this voxel's
+warm_err		- the most squared error at which to start from warm
+field			- if not NULL, the same for every voxel of the previous
+				  frame, 2 * ENHANCED values per voxel
+field_err		- the most squared error at which to start from field
+
+cur_ratio = cur_a / (cur_a + cur_b)
+cur_ab = cur_a + cur_b
+
+Therefore:
+cur_a = cur_ab * cur_ratio
+cur_b = cur_ab * (1 - cur_ratio)
+cur_c = 1 - cur_ab
+
+Thus, as long as we clamp cur_ab and cur_ratio to [0,1],
+cur_a, cur_b and cur_c will all be in the range [0,1] and
+additionally sum to 1.
+
+We choose a position (cur_ratio, cur_ab) in a 2D plane
+and progressively move this point in either +x, +y, -x or -y
+directions by the value cur_step (clamped to [0,1])
+
+If the error sum of squares in voxel densities in A and B
+is reduced by any of these new points, we repeat with the
+new point as the base.
+
+If not, we reduce the value of cur_step and repeat with the
+current point.
+
+When cur_step < min_step we stop.
+
+Neighbouring voxels are usually in the same basin, so with field or
+warm we skip the coarse grid and start the iterative search from the
+same voxel's solution in the previous frame, or else the previous
+voxel's, unless its error here is too high.
+
+In the case of an enhanced algorithm, we do the same
+as the standard but permutate a, b, and c through
+the orders:
+a, b, c
+c, a, b
+b, c, a
+so that each spends two iterations as part of
+cur_ab and one as not (i.e. 1 - cur_ratio)
+This avoids bias towards/against a particular
+material
+We average out the values at the end
+*/
+template <typename FP, typename OT, int ENHANCED, bool ROTATE>
+static CPU_INLINE void dect_algo_cpu(
+	const int16_t * RESTRICT a, const int16_t * RESTRICT b,
+	FP alphaa, FP betaa, FP gammaa,
+	FP alphab, FP betab, FP gammab,
+	size_t idx,
+	OT * RESTRICT x,
+	OT * RESTRICT y,
+	OT * RESTRICT z,
+	FP min_step,
+	float * RESTRICT warm,
+	FP warm_err,
+	float * RESTRICT field,
+	FP field_err,
+	int16_t * RESTRICT m,
+	FP mr,
+	int idx_adjust,
+	int in_flip)
+{
+#ifdef __GNUC__
+#ifdef __x86_64__
+	__builtin_assume_aligned(a, 16);
+	__builtin_assume_aligned(b, 16);
+	__builtin_assume_aligned(x, 16);
+	__builtin_assume_aligned(y, 16);
+	__builtin_assume_aligned(z, 16);
+	__builtin_assume_aligned(m, 16);
+#endif
+#endif
+	FP dA = a[idx] ^ in_flip;
+	FP dB = b[idx] ^ in_flip;
+
+	/* Clamp actual value to the max/min of the input values */
+	FP maxA = std::max(alphaa, std::max(betaa, gammaa));
+	FP minA = std::min(alphaa, std::min(betaa, gammaa));
+	FP maxB = std::max(alphab, std::max(betab, gammab));
+	FP minB = std::min(alphab, std::min(betab, gammab));
+	dA = std::clamp(dA, minA, maxA);
+	dB = std::clamp(dB, minB, maxB);
+
+	FP tot_best_a = 0.0;
+	FP tot_best_b = 0.0;
+	FP tot_best_c = 0.0;
+
+	float *vfield = field ? field + idx * 2 * ENHANCED : NULL;
+
+	dect_algo_cpu_perm<FP, 0>(dA, dB, alphaa, betaa, gammaa,
+		alphab, betab, gammab, min_step,
+		warm, warm_err, vfield, field_err,
+		&tot_best_a, &tot_best_b, &tot_best_c);
+	if constexpr (ENHANCED > 1)
+	{
+		dect_algo_cpu_perm<FP, 1>(dA, dB, alphaa, betaa, gammaa,
+			alphab, betab, gammab, min_step,
+			warm ? warm + 2 : NULL, warm_err, vfield ? vfield + 2 : NULL,
+			field_err, &tot_best_a, &tot_best_b, &tot_best_c);
+	}
+	if constexpr (ENHANCED > 2)
+	{
+		dect_algo_cpu_perm<FP, 2>(dA, dB, alphaa, betaa, gammaa,
+			alphab, betab, gammab, min_step,
+			warm ? warm + 4 : NULL, warm_err, vfield ? vfield + 4 : NULL,
+			field_err, &tot_best_a, &tot_best_b, &tot_best_c);
+	}
+
+	if constexpr (ENHANCED > 1)
+	{
+		tot_best_a /= ENHANCED;
+		tot_best_b /= ENHANCED;
+		tot_best_c /= ENHANCED;
+	}
+
+	size_t out_idx = dect_algo_cpu_out_idx<ROTATE>(idx, idx_adjust);
+
+	x[out_idx] = dect_algo_cpu_output<OT>(tot_best_a);
+	y[out_idx] = dect_algo_cpu_output<OT>(tot_best_b);
+	z[out_idx] = dect_algo_cpu_output<OT>(tot_best_c);
+
+	if (m)
+	{
+		m[out_idx] = (int16_t)((FP)(a[idx] ^ in_flip) * mr + (FP)(b[idx] ^ in_flip) * (1.0 - mr));
+	}
+}
+
+/* Vectorized version of the above
+
+This runs the same algorithm on SIMD_LANES voxels at once.  The coarse
+grid is identical for every voxel, so only the error calculation
+depends on the lane.  During the iterative search each lane keeps its
+own step size and lanes which have converged are masked out until
+all of them have finished.  The results are identical to dect_algo_cpu.
+
+With warm each lane instead takes its own run of consecutive voxels,
+so that every lane can start from its neighbour's solution.  Lanes
+with a seed, from warm or from field, skip the coarse grid and the
+others are packed together to run it.  warm then holds the solution of
+the last voxel.
+
+On x86-64 Linux the function is compiled for AVX-512, AVX2 and SSE4.1
+as well as the baseline and the best version is chosen at load time
+from CPUID.  The helpers it calls are always inlined so that they are
+compiled for the same instruction set.
+*/
+
+#define SIMD_LANES 16
+
+/* Lanes searched together on the coarse grid when only some need it */
+#define SIMD_GRID_LANES 4
+
+#ifndef SIMD_CLONES
+#if defined(__GNUC__) && defined(__x86_64__) && defined(__linux__)
+#define SIMD_CLONES __attribute__((target_clones("avx512f", "avx2", "sse4.1", "default")))
+#else
+#define SIMD_CLONES
+#endif
+#endif
+
+/* The coarse grid of dect_algo_cpu_simd_perm, for LANES voxels at once */
+template <typename FP, int LANES> static CPU_INLINE void dect_algo_cpu_simd_grid(
+	const FP *dA, const FP *dB,
+	FP calphaa, FP cbetaa, FP cgammaa,
+	FP calphab, FP cbetab, FP cgammab,
+	FP *best_ab, FP *best_ratio)
+{
+	FP best_err[LANES];
+	for (int l = 0; l < LANES; l++)
+	{
+		best_err[l] = 5000.0 * 5000.0;
+		best_ab[l] = 0.0;
+		best_ratio[l] = 0.0;
+	}
+
+	/* The estimates are the same for every lane */
+	for (FP test_ab = static_cast<FP>(0.0);
+		test_ab <= static_cast<FP>(1.0); test_ab += static_cast<FP>(0.1))
+	{
+		for (FP test_ratio = static_cast<FP>(0.0);
+			test_ratio <= static_cast<FP>(1.0); test_ratio += static_cast<FP>(0.1))
+		{
+			FP cur_a = test_ab * test_ratio;
+			FP cur_b = test_ab * (static_cast<FP>(1.0) - test_ratio);
+			FP cur_c = static_cast<FP>(1.0) - cur_a - cur_b;
+
+			FP dA_est = calphaa * cur_a + cbetaa * cur_b + cgammaa * cur_c;
+			FP dB_est = calphab * cur_a + cbetab * cur_b + cgammab * cur_c;
+
+#pragma omp simd
+			for (int l = 0; l < LANES; l++)
+			{
+				FP dA_err = (dA_est - dA[l]) * (dA_est - dA[l]);
+				FP dB_err = (dB_est - dB[l]) * (dB_est - dB[l]);
+				FP tot_err = dA_err + dB_err;
+
+				bool better = tot_err < best_err[l];
+				best_err[l] = better ? tot_err : best_err[l];
+				best_ab[l] = better ? test_ab : best_ab[l];
+				best_ratio[l] = better ? test_ratio : best_ratio[l];
+			}
+		}
+	}
+}
+
+/* One permutation of the search in dect_algo_cpu_simd, for the group of
+voxels starting at base */
+template <typename FP, int ENHANCED, int PERM> static CPU_INLINE void dect_algo_cpu_simd_perm(
+	const FP *dA, const FP *dB,
+	FP alphaa, FP betaa, FP gammaa,
+	FP alphab, FP betab, FP gammab,
+	size_t base, int lane_stride,
+	FP min_step,
+	float (*lane_warm)[2 * ENHANCED],
+	bool warm,
+	FP warm_err,
+	float * RESTRICT field,
+	FP field_err,
+	FP *tot_best_a, FP *tot_best_b, FP *tot_best_c)
+{
+	FP calphaa, cbetaa, cgammaa;
+	FP calphab, cbetab, cgammab;
+	dect_algo_cpu_permute<PERM>(alphaa, betaa, gammaa, &calphaa, &cbetaa, &cgammaa);
+	dect_algo_cpu_permute<PERM>(alphab, betab, gammab, &calphab, &cbetab, &cgammab);
+
+	FP seed_err[SIMD_LANES], seed_ab[SIMD_LANES], seed_ratio[SIMD_LANES];
+	FP grid_ab[SIMD_LANES], grid_ratio[SIMD_LANES];
+	bool seeded[SIMD_LANES];
+	int grid_lane[SIMD_LANES];
+	int grid_count = 0;
+	for (int l = 0; l < SIMD_LANES; l++)
+	{
+		const float *lfield = field ?
+			field + (base + l * lane_stride) * 2 * ENHANCED + 2 * PERM : NULL;
+		const float *seed = NULL;
+
+		if (dect_algo_cpu_seed<FP>(lfield, field_err, dA[l], dB[l],
+			calphaa, cbetaa, cgammaa, calphab, cbetab, cgammab, &seed_err[l]))
+			seed = lfield;
+		else if (warm && dect_algo_cpu_seed<FP>(lane_warm[l] + 2 * PERM, warm_err, dA[l], dB[l],
+			calphaa, cbetaa, cgammaa, calphab, cbetab, cgammab, &seed_err[l]))
+			seed = lane_warm[l] + 2 * PERM;
+
+		seeded[l] = seed != NULL;
+		seed_ab[l] = seeded[l] ? seed[0] : static_cast<FP>(0.0);
+		seed_ratio[l] = seeded[l] ? seed[1] : static_cast<FP>(0.0);
+		grid_ab[l] = 0.0;
+		grid_ratio[l] = 0.0;
+		if (!seeded[l])
+			grid_lane[grid_count++] = l;
+	}
+
+	/* Coarse grid, for the lanes without a seed only.  When some have
+	 * one the others are packed together and searched SIMD_GRID_LANES at
+	 * a time, so that its cost scales with their number. */
+	if (grid_count == SIMD_LANES)
+	{
+		dect_algo_cpu_simd_grid<FP, SIMD_LANES>(dA, dB,
+			calphaa, cbetaa, cgammaa, calphab, cbetab, cgammab,
+			grid_ab, grid_ratio);
+	}
+	else
+	{
+		for (int chunk = 0; chunk < grid_count; chunk += SIMD_GRID_LANES)
+		{
+			FP chunk_dA[SIMD_GRID_LANES], chunk_dB[SIMD_GRID_LANES];
+			FP chunk_ab[SIMD_GRID_LANES], chunk_ratio[SIMD_GRID_LANES];
+			for (int i = 0; i < SIMD_GRID_LANES; i++)
+			{
+				/* The padding repeats the last lane */
+				int l = grid_lane[std::min(chunk + i, grid_count - 1)];
+				chunk_dA[i] = dA[l];
+				chunk_dB[i] = dB[l];
+			}
+
+			dect_algo_cpu_simd_grid<FP, SIMD_GRID_LANES>(chunk_dA, chunk_dB,
+				calphaa, cbetaa, cgammaa, calphab, cbetab, cgammab,
+				chunk_ab, chunk_ratio);
+
+			for (int i = 0; i < SIMD_GRID_LANES && chunk + i < grid_count; i++)
+			{
+				grid_ab[grid_lane[chunk + i]] = chunk_ab[i];
+				grid_ratio[grid_lane[chunk + i]] = chunk_ratio[i];
+			}
+		}
+	}
+
+	/* Iterative search, with converged lanes masked out.  The lane state is
+	 * double buffered so that every store in the update loop is unconditional. */
+	FP state[2][4][SIMD_LANES];
+	FP *cur_step = state[0][0], *cur_error = state[0][1];
+	FP *cur_ab = state[0][2], *cur_ratio = state[0][3];
+	FP *next_step = state[1][0], *next_error = state[1][1];
+	FP *next_ab = state[1][2], *next_ratio = state[1][3];
+	for (int l = 0; l < SIMD_LANES; l++)
+	{
+		cur_step[l] = static_cast<FP>(0.05);
+		cur_error[l] = seeded[l] ? seed_err[l] : static_cast<FP>(5000.0 * 5000.0);
+		cur_ab[l] = seeded[l] ? seed_ab[l] : grid_ab[l];
+		cur_ratio[l] = seeded[l] ? seed_ratio[l] : grid_ratio[l];
+	}
+
+	while (true)
+	{
+		FP max_step = cur_step[0];
+		for (int l = 1; l < SIMD_LANES; l++)
+			max_step = cur_step[l] > max_step ? cur_step[l] : max_step;
+		if (max_step < min_step)
+			break;
+
+#pragma omp simd
+		for (int l = 0; l < SIMD_LANES; l++)
+		{
+			FP ab = cur_ab[l];
+			FP ratio = cur_ratio[l];
+			FP step = cur_step[l];
+
+			/* The four directions, in the same order as dect_algo_cpu */
+			FP ab0 = ab + step;
+			FP ratio1 = ratio + step;
+			FP ab2 = ab - step;
+			FP ratio3 = ratio - step;
+			ab0 = ab0 > static_cast<FP>(1.0) ? static_cast<FP>(1.0) : ab0;
+			ratio1 = ratio1 > static_cast<FP>(1.0) ? static_cast<FP>(1.0) : ratio1;
+			ab2 = ab2 < static_cast<FP>(0.0) ? static_cast<FP>(0.0) : ab2;
+			ratio3 = ratio3 < static_cast<FP>(0.0) ? static_cast<FP>(0.0) : ratio3;
+
+			FP err0 = dect_algo_cpu_err<FP>(ab0, ratio, dA[l], dB[l],
+				calphaa, cbetaa, cgammaa, calphab, cbetab, cgammab);
+			FP err1 = dect_algo_cpu_err<FP>(ab, ratio1, dA[l], dB[l],
+				calphaa, cbetaa, cgammaa, calphab, cbetab, cgammab);
+			FP err2 = dect_algo_cpu_err<FP>(ab2, ratio, dA[l], dB[l],
+				calphaa, cbetaa, cgammaa, calphab, cbetab, cgammab);
+			FP err3 = dect_algo_cpu_err<FP>(ab, ratio3, dA[l], dB[l],
+				calphaa, cbetaa, cgammaa, calphab, cbetab, cgammab);
+
+			FP min_err = err0;
+			FP min_ab = ab0;
+			FP min_ratio = ratio;
+
+			bool better = err1 < min_err;
+			min_err = better ? err1 : min_err;
+			min_ab = better ? ab : min_ab;
+			min_ratio = better ? ratio1 : min_ratio;
+
+			better = err2 < min_err;
+			min_err = better ? err2 : min_err;
+			min_ab = better ? ab2 : min_ab;
+			min_ratio = better ? ratio : min_ratio;
+
+			better = err3 < min_err;
+			min_err = better ? err3 : min_err;
+			min_ab = better ? ab : min_ab;
+			min_ratio = better ? ratio3 : min_ratio;
+
+			bool lane_active = step >= min_step;
+			bool move = lane_active & (min_err < cur_error[l]);
+			bool shrink = lane_active & !move;
+
+			next_ratio[l] = move ? min_ratio : ratio;
+			next_ab[l] = move ? min_ab : ab;
+			next_error[l] = move ? min_err : cur_error[l];
+			next_step[l] = shrink ? step / static_cast<FP>(2.0) : step;
+		}
+
+		std::swap(cur_step, next_step);
+		std::swap(cur_error, next_error);
+		std::swap(cur_ab, next_ab);
+		std::swap(cur_ratio, next_ratio);
+	}
+
+	for (int l = 0; l < SIMD_LANES; l++)
+	{
+		lane_warm[l][2 * PERM] = (float)cur_ab[l];
+		lane_warm[l][2 * PERM + 1] = (float)cur_ratio[l];
+		if (field)
+		{
+			float *lfield = field + (base + l * lane_stride) * 2 * ENHANCED;
+			lfield[2 * PERM] = (float)cur_ab[l];
+			lfield[2 * PERM + 1] = (float)cur_ratio[l];
+		}
+	}
+
+	for (int l = 0; l < SIMD_LANES; l++)
+	{
+		dect_algo_cpu_accumulate<PERM>(cur_ab[l], cur_ratio[l],
+			&tot_best_a[l], &tot_best_b[l], &tot_best_c[l]);
+	}
+}
+
+template <typename FP, typename OT, int ENHANCED, bool ROTATE>
+SIMD_CLONES
+static void dect_algo_cpu_simd(
+	const int16_t * RESTRICT a, const int16_t * RESTRICT b,
+	FP alphaa, FP betaa, FP gammaa,
+	FP alphab, FP betab, FP gammab,
+	size_t start, int count,
+	OT * RESTRICT x,
+	OT * RESTRICT y,
+	OT * RESTRICT z,
+	FP min_step,
+	float * RESTRICT warm,
+	FP warm_err,
+	float * RESTRICT field,
+	FP field_err,
+	int16_t * RESTRICT m,
+	FP mr,
+	int idx_adjust,
+	int in_flip)
+{
+	FP maxA = std::max(alphaa, std::max(betaa, gammaa));
+	FP minA = std::min(alphaa, std::min(betaa, gammaa));
+	FP maxB = std::max(alphab, std::max(betab, gammab));
+	FP minB = std::min(alphab, std::min(betab, gammab));
+
+	int groups = count / SIMD_LANES;
+	int group_stride = warm ? 1 : SIMD_LANES;
+	int lane_stride = warm ? groups : 1;
+
+	float lane_warm[SIMD_LANES][2 * ENHANCED];
+	for (int l = 0; l < SIMD_LANES; l++)
+	{
+		for (int j = 0; j < 2 * ENHANCED; j++)
+			lane_warm[l][j] = -1.0f;
+	}
+
+	for (int g = 0; g < groups; g++)
+	{
+		size_t base = start + g * group_stride;
+
+		FP dA[SIMD_LANES], dB[SIMD_LANES];
+		FP tot_best_a[SIMD_LANES], tot_best_b[SIMD_LANES], tot_best_c[SIMD_LANES];
+
+		for (int l = 0; l < SIMD_LANES; l++)
+		{
+			dA[l] = std::min(std::max((FP)(a[base + l * lane_stride] ^ in_flip), minA), maxA);
+			dB[l] = std::min(std::max((FP)(b[base + l * lane_stride] ^ in_flip), minB), maxB);
+			tot_best_a[l] = 0.0;
+			tot_best_b[l] = 0.0;
+			tot_best_c[l] = 0.0;
+		}
+
+		dect_algo_cpu_simd_perm<FP, ENHANCED, 0>(dA, dB,
+			alphaa, betaa, gammaa, alphab, betab, gammab,
+			base, lane_stride, min_step,
+			lane_warm, warm != NULL, warm_err, field, field_err,
+			tot_best_a, tot_best_b, tot_best_c);
+		if constexpr (ENHANCED > 1)
+		{
+			dect_algo_cpu_simd_perm<FP, ENHANCED, 1>(dA, dB,
+				alphaa, betaa, gammaa, alphab, betab, gammab,
+				base, lane_stride, min_step,
+				lane_warm, warm != NULL, warm_err, field, field_err,
+				tot_best_a, tot_best_b, tot_best_c);
+		}
+		if constexpr (ENHANCED > 2)
+		{
+			dect_algo_cpu_simd_perm<FP, ENHANCED, 2>(dA, dB,
+				alphaa, betaa, gammaa, alphab, betab, gammab,
+				base, lane_stride, min_step,
+				lane_warm, warm != NULL, warm_err, field, field_err,
+				tot_best_a, tot_best_b, tot_best_c);
+		}
+
+		for (int l = 0; l < SIMD_LANES; l++)
+		{
+			size_t idx = base + l * lane_stride;
+
+			if constexpr (ENHANCED > 1)
+			{
+				tot_best_a[l] /= ENHANCED;
+				tot_best_b[l] /= ENHANCED;
+				tot_best_c[l] /= ENHANCED;
+			}
+
+			size_t out_idx = dect_algo_cpu_out_idx<ROTATE>(idx, idx_adjust);
+
+			x[out_idx] = dect_algo_cpu_output<OT>(tot_best_a[l]);
+			y[out_idx] = dect_algo_cpu_output<OT>(tot_best_b[l]);
+			z[out_idx] = dect_algo_cpu_output<OT>(tot_best_c[l]);
+
+			if (m)
+				m[out_idx] = (int16_t)((FP)(a[idx] ^ in_flip) * mr +
+					(FP)(b[idx] ^ in_flip) * (1.0 - mr));
+		}
+	}
+
+	if (warm && groups > 0)
+	{
+		for (int j = 0; j < 2 * ENHANCED; j++)
+			warm[j] = lane_warm[SIMD_LANES - 1][j];
+	}
+}
+
+/* Voxels are handed out to the threads in tiles of this many.  The
+search time varies a lot between voxels so the tiles are scheduled
+dynamically, and they are small enough to keep a large machine busy
+on a single slice. */
+#define CPU_TILE_SIZE (SIMD_LANES * 16)
+
+/* Give a voxel outside the mask the fill value, without searching.  The
+merged image only depends on the inputs so it is still produced. */
+template <typename FP, typename OT, bool ROTATE>
+static inline void dect_algo_cpu_fill(
+	const int16_t * RESTRICT a, const int16_t * RESTRICT b,
+	size_t idx,
+	OT * RESTRICT x,
+	OT * RESTRICT y,
+	OT * RESTRICT z,
+	OT fill,
+	int16_t * RESTRICT m,
+	FP mr,
+	int idx_adjust,
+	int in_flip)
+{
+	size_t out_idx = dect_algo_cpu_out_idx<ROTATE>(idx, idx_adjust);
+
+	x[out_idx] = fill;
+	y[out_idx] = fill;
+	z[out_idx] = fill;
+
+	if (m)
+		m[out_idx] = (int16_t)((FP)(a[idx] ^ in_flip) * mr + (FP)(b[idx] ^ in_flip) * (1.0 - mr));
+}
+
+template <typename FP, typename OT, int ENHANCED, bool ROTATE>
+static void dect_algo_cpu_iter_tile(
+	const cpu_iter_params *p,
+	size_t start,
+	int count)
+{
+	/* Voxels where both inputs are below mask_below are outside the
+	mask.  Tiles entirely outside it are only filled, and the few tiles
+	on its edge are searched as usual with the outside voxels filled
+	afterwards, which keeps the SIMD path. */
+	const int16_t * RESTRICT a = p->a;
+	const int16_t * RESTRICT b = p->b;
+	OT * RESTRICT x = (OT *)p->x;
+	OT * RESTRICT y = (OT *)p->y;
+	OT * RESTRICT z = (OT *)p->z;
+	int16_t * RESTRICT m = p->m;
+	FP mr = p->mr;
+	int idx_adjust = p->idx_adjust;
+	int in_flip = p->in_flip;
+	int mask_below = p->mask_below;
+	float *field = p->field;
+
+	int inside = count;
+	if (mask_below > INT16_MIN)
+	{
+		inside = 0;
+		for (size_t i = start; i < start + count; i++)
+		{
+			if ((a[i] ^ in_flip) >= mask_below || (b[i] ^ in_flip) >= mask_below)
+				inside++;
+		}
+	}
+
+	OT fill = dect_algo_cpu_output<OT>(p->mask_fill);
+	if (inside == 0)
+	{
+		for (size_t i = start; i < start + count; i++)
+			dect_algo_cpu_fill<FP, OT, ROTATE>(a, b, i, x, y, z, fill, m, mr,
+				idx_adjust, in_flip);
+		if (field)
+			std::fill(field + start * 2 * ENHANCED,
+				field + (start + count) * 2 * ENHANCED, -1.0f);
+		return;
+	}
+
+	/* With a warm start each voxel begins from the one before it in the
+	tile, which is usually its neighbour in the row */
+	float warm_buf[2 * ENHANCED];
+	std::fill(warm_buf, warm_buf + 2 * ENHANCED, -1.0f);
+	float *warm = p->warm_start > 0.0f ? warm_buf : NULL;
+	FP warm_err = (FP)p->warm_start * (FP)p->warm_start;
+	FP field_err = (FP)p->field_start * (FP)p->field_start;
+
+	int done = 0;
+
+	if (p->use_simd)
+	{
+		done = count / SIMD_LANES * SIMD_LANES;
+		dect_algo_cpu_simd<FP, OT, ENHANCED, ROTATE>(a, b, p->alphaa, p->betaa, p->gammaa,
+			p->alphab, p->betab, p->gammab, start, done, x, y, z, p->min_step,
+			warm, warm_err, field, field_err, m, mr, idx_adjust,
+			in_flip);
+	}
+
+	for (int i = done; i < count; i++)
+	{
+		dect_algo_cpu<FP, OT, ENHANCED, ROTATE>(a, b, p->alphaa, p->betaa, p->gammaa,
+			p->alphab, p->betab, p->gammab, start + i, x, y, z, p->min_step,
+			warm, warm_err, field, field_err, m, mr, idx_adjust,
+			in_flip);
+	}
+
+	if (inside < count)
+	{
+		for (size_t i = start; i < start + count; i++)
+		{
+			if ((a[i] ^ in_flip) < mask_below && (b[i] ^ in_flip) < mask_below)
+				dect_algo_cpu_fill<FP, OT, ROTATE>(a, b, i, x, y, z, fill, m, mr,
+					idx_adjust, in_flip);
+		}
+	}
+}
+
+template <typename FP, typename OT, int ENHANCED, bool ROTATE>
+static int dect_algo_cpu_run(const cpu_iter_params *p)
+{
+	long long tiles = (long long)((p->pix_count + CPU_TILE_SIZE - 1) / CPU_TILE_SIZE);
+
+#pragma omp parallel for schedule(dynamic, 1)
+	for (long long i = 0; i < tiles; i++)
+	{
+		size_t start = (size_t)i * CPU_TILE_SIZE;
+		size_t count = std::min((size_t)CPU_TILE_SIZE, p->pix_count - start);
+
+		dect_algo_cpu_iter_tile<FP, OT, ENHANCED, ROTATE>(p, start, (int)count);
+	}
+
+	return 0;
+}
+
+template <typename FP, typename OT> cpu_run_func dect_algo_cpu_select(
+	int enhanced, int idx_adjust)
+{
+	static const cpu_run_func funcs[3][2] =
+	{
+		{ dect_algo_cpu_run<FP, OT, 1, false>, dect_algo_cpu_run<FP, OT, 1, true> },
+		{ dect_algo_cpu_run<FP, OT, 2, false>, dect_algo_cpu_run<FP, OT, 2, true> },
+		{ dect_algo_cpu_run<FP, OT, 3, false>, dect_algo_cpu_run<FP, OT, 3, true> },
+	};
+
+	return funcs[enhanced - 1][idx_adjust ? 1 : 0];
+}
+
+#endif
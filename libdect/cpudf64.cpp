@@ -1,4 +1,4 @@
-/* Copyright (C) 2016 by John Cronin
+/* Copyright (C) 2016-2020 by John Cronin
 *
 * Permission is hereby granted, free of charge, to any person obtaining a copy
 * of this software and associated documentation files (the "Software"), to deal
@@ -19,12 +19,9 @@
 * THE SOFTWARE.
 */
 
-// float version of cpu algorithm
 
-#define dect_algo_cpu_iter dect_algo_cpudf64_iter
-#define FPTYPE double
-#define OTYPE double
-#define OTYPE_MAX 1.0
-#define FLOOR_FUNC  
+// cpu algorithm in double precision, double output
 
-#include "cpu_template.cpp"
+#include "cpu_template.h"
+
+template cpu_run_func dect_algo_cpu_select<double, double>(int, int);
@@ -1,4 +1,4 @@
-/* Copyright (C) 2016 by John Cronin
+/* Copyright (C) 2016-2020 by John Cronin
 *
 * Permission is hereby granted, free of charge, to any person obtaining a copy
 * of this software and associated documentation files (the "Software"), to deal
@@ -19,11 +19,9 @@
 * THE SOFTWARE.
 */
 
-// float version of cpu algorithm
 
-#define dect_algo_cpu_iter dect_algo_cpuf16_iter
-#define FPTYPE float
-#define OTYPE uint16_t
-#define OTYPE_MAX 65535.0
+// cpu algorithm in single precision, 16 bit output
 
-#include "cpu_template.cpp"
+#include "cpu_template.h"
+
+template cpu_run_func dect_algo_cpu_select<float, uint16_t>(int, int);
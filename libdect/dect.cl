@@ -25,16 +25,41 @@ const std::string ks = R"OPENCL(
 #define FLOOR_FUNC floor
 #endif
 
+/* No fused multiply-adds, as on the host, so that the coarse tables
+	coarse_table makes for a specialized build are bit for bit the values
+	the general kernels work out */
+#pragma OPENCL FP_CONTRACT OFF
+
+/* A specialized build has the densities and min_step baked in as the SP_
+	defines, and the coarse search's predicted densities precomputed in
+	coarse_a_est and coarse_b_est.  The kernels keep the same arguments,
+	but ignore those that have been baked in. */
+#ifdef SPECIALIZED
+#define PARAM(name) name##_unused
+#define SPECIAL_PARAMS \
+	const FPTYPE alphaa = SP_ALPHAA; \
+	const FPTYPE betaa = SP_BETAA; \
+	const FPTYPE gammaa = SP_GAMMAA; \
+	const FPTYPE alphab = SP_ALPHAB; \
+	const FPTYPE betab = SP_BETAB; \
+	const FPTYPE gammab = SP_GAMMAB; \
+	const FPTYPE min_step = SP_MIN_STEP;
+#else
+#define PARAM(name) name
+#define SPECIAL_PARAMS
+#endif
+
 kernel void dect(global short *a, global short *b,
-	const FPTYPE alphaa, const FPTYPE betaa, const FPTYPE gammaa,
-	const FPTYPE alphab, const FPTYPE betab, const FPTYPE gammab,
+	const FPTYPE PARAM(alphaa), const FPTYPE PARAM(betaa), const FPTYPE PARAM(gammaa),
+	const FPTYPE PARAM(alphab), const FPTYPE PARAM(betab), const FPTYPE PARAM(gammab),
 	global OTYPE *x, global OTYPE *y, global OTYPE *z,
-	const FPTYPE min_step,
+	const FPTYPE PARAM(min_step),
 	global short *m,
 	const FPTYPE mr,
 	const int do_merge,
 	const int idx_adjust)
 {
+	SPECIAL_PARAMS
 	size_t idx = get_global_id(0);
 
 	FPTYPE dA = (FPTYPE)a[idx];
@@ -58,6 +83,23 @@ kernel void dect(global short *a, global short *b,
 	FPTYPE best_ab = 0.66;
 	FPTYPE best_ratio = 0.5;
 
+#ifdef SPECIALIZED
+	/* The same grid, in the same order */
+	for (int j = 0; j < COARSE_COUNT; j++)
+	{
+		FPTYPE dA_err = (coarse_a_est[0][j] - dA) * (coarse_a_est[0][j] - dA);
+		FPTYPE dB_err = (coarse_b_est[0][j] - dB) * (coarse_b_est[0][j] - dB);
+
+		FPTYPE tot_err = dA_err + dB_err;
+
+		if (tot_err < best_err)
+		{
+			best_err = tot_err;
+			best_ab = coarse_ab[j];
+			best_ratio = coarse_ratio[j];
+		}
+	}
+#else
 	for (FPTYPE test_ab = 0.0; test_ab <= 1.0; test_ab += 0.1)
 	{
 		for (FPTYPE test_ratio = 0.0; test_ratio <= 1.0; test_ratio += 0.1)
@@ -84,6 +126,7 @@ kernel void dect(global short *a, global short *b,
 			}
 		}
 	}
+#endif
 
 	/* Now do an iterative search to find the best values */
 	FPTYPE cur_error = 5000.0 * 5000.0;
@@ -163,31 +206,33 @@ kernel void dect(global short *a, global short *b,
 		}
 	}
 
+	size_t out_idx = idx;
 	if(idx_adjust)
-		idx = idx_adjust - idx;
+		out_idx = idx_adjust - idx;
 
 	OTYPE best_a = (OTYPE)FLOOR_FUNC(cur_ab * cur_ratio * OTYPE_MAX);
 	OTYPE best_b = (OTYPE)FLOOR_FUNC(cur_ab * (1.0 - cur_ratio) * OTYPE_MAX);
 	OTYPE best_c = (OTYPE)FLOOR_FUNC((1.0 - cur_ab) * OTYPE_MAX);
 
-	x[idx] = best_a;
-	y[idx] = best_b;
-	z[idx] = best_c;
+	x[out_idx] = best_a;
+	y[out_idx] = best_b;
+	z[out_idx] = best_c;
 
 	if(do_merge)
-		m[idx] = (short)((FPTYPE)a[idx] * mr + (FPTYPE)b[idx] * (1.0 - mr));
+		m[out_idx] = (short)((FPTYPE)a[idx] * mr + (FPTYPE)b[idx] * (1.0 - mr));
 }
 
 kernel void dect2(global short *a, global short *b,
-	FPTYPE alphaa, FPTYPE betaa, FPTYPE gammaa,
-	FPTYPE alphab, FPTYPE betab, FPTYPE gammab,
+	FPTYPE PARAM(alphaa), FPTYPE PARAM(betaa), FPTYPE PARAM(gammaa),
+	FPTYPE PARAM(alphab), FPTYPE PARAM(betab), FPTYPE PARAM(gammab),
 	global OTYPE *x, global OTYPE *y, global OTYPE *z,
-	FPTYPE min_step,
+	FPTYPE PARAM(min_step),
 	global short *m,
 	FPTYPE mr,
 	int do_merge,
 	int idx_adjust)
 {
+	SPECIAL_PARAMS
 	size_t idx = get_global_id(0);
 
 	FPTYPE dA = a[idx];
@@ -256,6 +301,23 @@ kernel void dect2(global short *a, global short *b,
 		FPTYPE best_ab = 0.0;
 		FPTYPE best_ratio = 0.0;
 
+#ifdef SPECIALIZED
+		/* The same grid, in the same order */
+		for (int j = 0; j < COARSE_COUNT; j++)
+		{
+			FPTYPE dA_err = (coarse_a_est[i][j] - dA) * (coarse_a_est[i][j] - dA);
+			FPTYPE dB_err = (coarse_b_est[i][j] - dB) * (coarse_b_est[i][j] - dB);
+
+			FPTYPE tot_err = dA_err + dB_err;
+
+			if (tot_err < best_err)
+			{
+				best_err = tot_err;
+				best_ab = coarse_ab[j];
+				best_ratio = coarse_ratio[j];
+			}
+		}
+#else
 		for (FPTYPE test_ab = 0.0; test_ab <= 1.0; test_ab += 0.1)
 		{
 			for (FPTYPE test_ratio = 0.0; test_ratio <= 1.0; test_ratio += 0.1)
@@ -280,6 +342,7 @@ kernel void dect2(global short *a, global short *b,
 				}
 			}
 		}
+#endif
 
 		/* Now do an iterative search to find the best values */
 		FPTYPE cur_step = 0.05;
@@ -382,19 +445,170 @@ kernel void dect2(global short *a, global short *b,
 		tot_best_c += cur_best_c;
 	}
 
+	size_t out_idx = idx;
 	if(idx_adjust)
-		idx = idx_adjust - idx;
+		out_idx = idx_adjust - idx;
 
 	OTYPE best_a = (OTYPE)FLOOR_FUNC(tot_best_a / 3.0 * OTYPE_MAX);
 	OTYPE best_b = (OTYPE)FLOOR_FUNC(tot_best_b / 3.0 * OTYPE_MAX);
 	OTYPE best_c = (OTYPE)FLOOR_FUNC(tot_best_c / 3.0 * OTYPE_MAX);
 
-	x[idx] = best_a;
-	y[idx] = best_b;
-	z[idx] = best_c;
+	x[out_idx] = best_a;
+	y[out_idx] = best_b;
+	z[out_idx] = best_c;
 
 	if(do_merge)
-		m[idx] = (short)((FPTYPE)a[idx] * mr + (FPTYPE)b[idx] * (1.0 - mr));
+		m[out_idx] = (short)((FPTYPE)a[idx] * mr + (FPTYPE)b[idx] * (1.0 - mr));
+}
+
+#ifndef SPECIALIZED
+/* The coarse grid of dect, or of dect2 when enhanced is 3, and the
+	densities it predicts for each of its points, for a specialized build
+	to bake in.  Work item i takes dect2's permutation i, and at most
+	max_count points are written to each table, with the number there are
+	in count. */
+kernel void coarse_table(
+	const FPTYPE alphaa, const FPTYPE betaa, const FPTYPE gammaa,
+	const FPTYPE alphab, const FPTYPE betab, const FPTYPE gammab,
+	const int enhanced,
+	const int max_count,
+	global FPTYPE *ab, global FPTYPE *ratio,
+	global FPTYPE *a_est, global FPTYPE *b_est,
+	global int *count)
+{
+	int i = get_global_id(0);
+
+	FPTYPE calphaa, cbetaa, cgammaa;
+	FPTYPE calphab, cbetab, cgammab;
+
+	switch(i)
+	{
+		case 0:
+			calphaa = alphaa;
+			cbetaa = betaa;
+			cgammaa = gammaa;
+			calphab = alphab;
+			cbetab = betab;
+			cgammab = gammab;
+			break;
+		case 1:
+			calphaa = gammaa;
+			cbetaa = alphaa;
+			cgammaa = betaa;
+			calphab = gammab;
+			cbetab = alphab;
+			cgammab = betab;
+			break;
+		default:
+			calphaa = betaa;
+			cbetaa = gammaa;
+			cgammaa = alphaa;
+			calphab = betab;
+			cbetab = gammab;
+			cgammab = alphab;
+			break;
+	}
+
+	int j = 0;
+	for (FPTYPE test_ab = 0.0; test_ab <= 1.0; test_ab += 0.1)
+	{
+		for (FPTYPE test_ratio = 0.0; test_ratio <= 1.0; test_ratio += 0.1)
+		{
+			FPTYPE cur_a = test_ab * test_ratio;
+			FPTYPE cur_b = test_ab * (1.0 - test_ratio);
+			FPTYPE cur_c;
+			if (enhanced == 3)
+				cur_c = 1.0 - cur_a - cur_b;
+			else
+				cur_c = 1.0 - test_ab;
+
+			if (j < max_count)
+			{
+				a_est[i * max_count + j] = calphaa * cur_a + cbetaa * cur_b + cgammaa * cur_c;
+				b_est[i * max_count + j] = calphab * cur_a + cbetab * cur_b + cgammab * cur_c;
+				if (i == 0)
+				{
+					ab[j] = test_ab;
+					ratio[j] = test_ratio;
+				}
+			}
+			j++;
+		}
+	}
+
+	if (i == 0)
+		*count = j;
+}
+#endif
+
+/* A fraction as an output value, clamped to the output range */
+#define SIMUL_OUTPUT(v) ((OTYPE)clamp((v) * (float)OTYPE_MAX, 0.0f, (float)OTYPE_MAX))
+
+/* The simultaneous equation solution, as the CPU's dect_algo_simul, for
+	previews.  It takes the same arguments as dect so that frames are
+	queued in the same way, but min_step is unused and, like the CPU
+	version, it always works in single precision. */
+kernel void simul(global short *a, global short *b,
+	const FPTYPE alphaa, const FPTYPE betaa, const FPTYPE gammaa,
+	const FPTYPE alphab, const FPTYPE betab, const FPTYPE gammab,
+	global OTYPE *x, global OTYPE *y, global OTYPE *z,
+	const FPTYPE min_step,
+	global short *m,
+	const FPTYPE mr,
+	const int do_merge,
+	const int idx_adjust)
+{
+	size_t idx = get_global_id(0);
+
+	float theta = a[idx];
+	float phi = b[idx];
+
+	float alpha = (float)alphaa - (float)gammaa;
+	float beta = (float)betaa - (float)gammaa;
+	float gamma = (float)alphab - (float)gammab;
+	float delta = (float)betab - (float)gammab;
+
+	float epsilon = delta / beta;
+	float curx = (phi - (float)gammab - epsilon * (theta - (float)gammaa)) /
+		(gamma - alpha * epsilon);
+	float cury = (theta - (float)gammaa - curx * alpha) / beta;
+	float curz = 1.0f - curx - cury;
+
+	size_t out_idx = idx;
+	if(idx_adjust)
+		out_idx = idx_adjust - idx;
+
+	x[out_idx] = SIMUL_OUTPUT(curx);
+	y[out_idx] = SIMUL_OUTPUT(cury);
+	z[out_idx] = SIMUL_OUTPUT(curz);
+
+	if(do_merge)
+		m[out_idx] = (short)(theta * (float)mr + phi * (1.0f - (float)mr));
+}
+
+/* The densities in a and b of the fractions in x, y and z, as
+	dect_reconstitute works them out */
+kernel void reconstitute(global OTYPE *x, global OTYPE *y, global OTYPE *z,
+	const float alphaa, const float betaa, const float gammaa,
+	const float alphab, const float betab, const float gammab,
+	global short *a, global short *b,
+	const int idx_adjust)
+{
+	size_t idx = get_global_id(0);
+
+	float curx = (float)x[idx] / (float)OTYPE_MAX;
+	float cury = (float)y[idx] / (float)OTYPE_MAX;
+	float curz = (float)z[idx] / (float)OTYPE_MAX;
+
+	float cura = curx * alphaa + cury * betaa + curz * gammaa;
+	float curb = curx * alphab + cury * betab + curz * gammab;
+
+	size_t out_idx = idx;
+	if(idx_adjust)
+		out_idx = idx_adjust - idx;
+
+	a[out_idx] = (short)cura;
+	b[out_idx] = (short)curb;
 }
 
 )OPENCL";
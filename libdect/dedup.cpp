@@ -0,0 +1,263 @@
+/* Copyright (C) 2016-2020 by John Cronin
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#include <stdint.h>
+#include <math.h>
+#include <stddef.h>
+#include <algorithm>
+#include <vector>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#define IN_LIBDECT
+#include "libdect.h"
+#include "cpu.h"
+
+/* Per-frame deduplication
+
+CT frames contain large areas of identical values (air, soft tissue)
+so rather than running the cpu algorithm on every voxel we find the
+distinct clamped (a, b) pairs in the frame, solve only those and then
+scatter the results back.
+
+The pairs are found with open addressing hash tables.  Each thread
+takes a contiguous part of the frame and finds the distinct pairs in
+it, then the parts' pairs are merged in order, so the pairs are solved
+in the order they first appear in the frame whatever the number of
+threads.  As the clamped pairs are bounded by the densities, the tables
+never need more than twice as many entries as there are possible pairs.
+*/
+
+#define DEDUP_EMPTY UINT32_MAX
+
+/* The fewest voxels worth giving a thread of its own */
+#define DEDUP_MIN_PART (1 << 14)
+
+struct dedup_table
+{
+	std::vector<uint32_t> key;
+	std::vector<uint32_t> val;
+	size_t mask;
+	int shift;
+};
+
+/* Make the table at least twice as big as the keys it will hold */
+static void dedup_table_init(dedup_table *t, size_t max_keys)
+{
+	size_t size = 64;
+	int bits = 6;
+	while (size < max_keys * 2)
+	{
+		size <<= 1;
+		bits++;
+	}
+
+	t->key.resize(size);
+	t->val.assign(size, DEDUP_EMPTY);
+	t->mask = size - 1;
+	t->shift = 32 - std::min(bits, 32);
+}
+
+/* The value stored for key, or next if key is new, which is then
+	stored for it */
+static uint32_t dedup_table_find(dedup_table *t, uint32_t key, uint32_t next)
+{
+	size_t h = (size_t)((key * 2654435761U) >> t->shift) & t->mask;
+	while (t->val[h] != DEDUP_EMPTY && t->key[h] != key)
+		h = (h + 1) & t->mask;
+
+	if (t->val[h] == DEDUP_EMPTY)
+	{
+		t->key[h] = key;
+		t->val[h] = next;
+	}
+	return t->val[h];
+}
+
+template <typename FP, typename T> static void dedup_scatter(
+	const int16_t *a, const int16_t *b,
+	const uint32_t *pair_idx,
+	const T *ux, const T *uy, const T *uz,
+	T *x, T *y, T *z,
+	size_t pix_count,
+	int16_t *m,
+	FP mr,
+	int idx_adjust,
+	int in_flip)
+{
+#pragma omp parallel for
+	for (long long i = 0; i < (long long)pix_count; i++)
+	{
+		size_t idx = (size_t)i;
+		auto uidx = pair_idx[idx];
+
+		auto out_idx = idx;
+		if (idx_adjust)
+			out_idx = idx_adjust - idx;
+
+		x[out_idx] = ux[uidx];
+		y[out_idx] = uy[uidx];
+		z[out_idx] = uz[uidx];
+
+		if (m)
+			m[out_idx] = (int16_t)((FP)(a[idx] ^ in_flip) * mr +
+				(FP)(b[idx] ^ in_flip) * (1.0 - mr));
+	}
+}
+
+int dect_algo_dedup(int enhanced,
+	const int16_t *a, const int16_t *b,
+	float alphaa, float betaa, float gammaa,
+	float alphab, float betab, float gammab,
+	void *x, void *y, void *z,
+	size_t pix_count,
+	float min_step,
+	int16_t *m,
+	float mr,
+	int idx_adjust,
+	int use_single_fp,
+	libdect_output_type otype,
+	int use_simd,
+	float warm_start,
+	size_t *unique_pairs,
+	int in_flip)
+{
+	int lo_a, hi_a, lo_b, hi_b;
+	clamped_range(alphaa, betaa, gammaa, &lo_a, &hi_a);
+	clamped_range(alphab, betab, gammab, &lo_b, &hi_b);
+	size_t key_space = (size_t)(hi_a - lo_a + 1) * (size_t)(hi_b - lo_b + 1);
+
+	int nparts = 1;
+#ifdef _OPENMP
+	nparts = omp_get_max_threads();
+#endif
+	nparts = (int)std::max(std::min((size_t)nparts,
+		pix_count / DEDUP_MIN_PART), (size_t)1);
+
+	/* Each part's distinct keys, in the order they first appear, with
+		pair_idx holding the index into them for now */
+	std::vector<uint32_t> pair_idx(pix_count);
+	std::vector<std::vector<uint32_t>> part_keys(nparts);
+
+#pragma omp parallel for schedule(static, 1)
+	for (int p = 0; p < nparts; p++)
+	{
+		size_t start = pix_count * p / nparts;
+		size_t end = pix_count * (p + 1) / nparts;
+		auto &keys = part_keys[p];
+
+		dedup_table t;
+		dedup_table_init(&t, std::min(end - start, key_space));
+
+		for (size_t idx = start; idx < end; idx++)
+		{
+			int ca = std::clamp(a[idx] ^ in_flip, lo_a, hi_a);
+			int cb = std::clamp(b[idx] ^ in_flip, lo_b, hi_b);
+			uint32_t key = ((uint32_t)(ca - lo_a) << 16) | (uint32_t)(cb - lo_b);
+
+			auto val = dedup_table_find(&t, key, (uint32_t)keys.size());
+			if (val == keys.size())
+				keys.push_back(key);
+			pair_idx[idx] = val;
+		}
+	}
+
+	/* Merge the parts in order, remapping their indices to the frame's */
+	size_t part_total = 0;
+	for (int p = 0; p < nparts; p++)
+		part_total += part_keys[p].size();
+
+	dedup_table t;
+	dedup_table_init(&t, std::min(part_total, key_space));
+
+	std::vector<int16_t> ua, ub;
+	std::vector<std::vector<uint32_t>> part_remap(nparts);
+	for (int p = 0; p < nparts; p++)
+	{
+		auto &keys = part_keys[p];
+		auto &remap = part_remap[p];
+		remap.resize(keys.size());
+
+		for (size_t i = 0; i < keys.size(); i++)
+		{
+			auto key = keys[i];
+			auto val = dedup_table_find(&t, key, (uint32_t)ua.size());
+			if (val == ua.size())
+			{
+				ua.push_back((int16_t)((int)(key >> 16) + lo_a));
+				ub.push_back((int16_t)((int)(key & 0xffff) + lo_b));
+			}
+			remap[i] = val;
+		}
+	}
+
+#pragma omp parallel for schedule(static, 1)
+	for (int p = 0; p < nparts; p++)
+	{
+		size_t start = pix_count * p / nparts;
+		size_t end = pix_count * (p + 1) / nparts;
+		auto &remap = part_remap[p];
+
+		for (size_t idx = start; idx < end; idx++)
+			pair_idx[idx] = remap[pair_idx[idx]];
+	}
+
+	size_t unique = ua.size();
+	if (unique_pairs)
+		*unique_pairs = unique;
+
+	auto esize = otype_size(otype);
+	std::vector<uint8_t> ux(unique * esize), uy(unique * esize), uz(unique * esize);
+
+	cpu_iter_params cp;
+	cp.enhanced = enhanced;
+	cp.a = ua.data();
+	cp.b = ub.data();
+	cp.alphaa = alphaa;
+	cp.betaa = betaa;
+	cp.gammaa = gammaa;
+	cp.alphab = alphab;
+	cp.betab = betab;
+	cp.gammab = gammab;
+	cp.x = ux.data();
+	cp.y = uy.data();
+	cp.z = uz.data();
+	cp.pix_count = unique;
+	cp.min_step = min_step;
+	cp.use_single_fp = use_single_fp;
+	cp.otype = otype;
+	cp.use_simd = use_simd;
+	cp.warm_start = warm_start;
+
+	auto ret = dect_algo_cpu_iter(&cp);
+	if (ret != 0)
+		return ret;
+
+	return cpu_type_dispatch(use_single_fp, otype, [&](auto *fp, auto *ot) {
+		typedef std::remove_pointer_t<decltype(fp)> FP;
+		typedef std::remove_pointer_t<decltype(ot)> OT;
+		dedup_scatter<FP>(a, b, pair_idx.data(),
+			(const OT *)ux.data(), (const OT *)uy.data(), (const OT *)uz.data(),
+			(OT *)x, (OT *)y, (OT *)z,
+			pix_count, m, (FP)mr, idx_adjust, in_flip);
+	});
+}
@@ -0,0 +1,508 @@
+/* Copyright (C) 2016-2020 by John Cronin
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#include <stdint.h>
+#include <math.h>
+#include <stddef.h>
+#include <algorithm>
+#include <vector>
+#include <type_traits>
+
+#define IN_LIBDECT
+#include "libdect.h"
+#include "cpu.h"
+
+/* Exact solution of the problem the cpu algorithm searches for
+
+We want x, y, z in [0,1] with x + y + z = 1 that minimise
+
+	(x * alphaa + y * betaa + z * gammaa - dA)^2 +
+	(x * alphab + y * betab + z * gammab - dB)^2
+
+If we let P1 = (alphaa, alphab), P2 = (betaa, betab) and
+P3 = (gammaa, gammab) be points in the (A, B) plane, then
+(x, y, z) are the barycentric coordinates of a point in the
+triangle P1 P2 P3 and the error is the squared distance from
+that point to D = (dA, dB).
+
+Therefore:
+	if D lies within the triangle, the simultaneous equation
+	solution (see simul.cpp) is exact and has zero error
+
+	otherwise, the closest point of the triangle lies on one
+	of its edges (or vertices), which we find by projecting D
+	onto each edge and keeping the nearest
+
+The result does not depend on the order of the materials, so the
+enhanced (permutated) variant gives the same answer.
+*/
+
+template <typename FP> struct exact_params
+{
+	FP p1a, p1b, p2a, p2b, p3a, p3b;
+	FP minA, maxA, minB, maxB;
+	FP ua, ub, va, vb;		/* P1 - P3, P2 - P3 */
+	FP det;
+};
+
+template <typename FP> static void exact_init(exact_params<FP> *p,
+	float alphaa, float betaa, float gammaa,
+	float alphab, float betab, float gammab)
+{
+	p->p1a = alphaa;
+	p->p1b = alphab;
+	p->p2a = betaa;
+	p->p2b = betab;
+	p->p3a = gammaa;
+	p->p3b = gammab;
+
+	p->maxA = std::max(p->p1a, std::max(p->p2a, p->p3a));
+	p->minA = std::min(p->p1a, std::min(p->p2a, p->p3a));
+	p->maxB = std::max(p->p1b, std::max(p->p2b, p->p3b));
+	p->minB = std::min(p->p1b, std::min(p->p2b, p->p3b));
+
+	p->ua = p->p1a - p->p3a;
+	p->ub = p->p1b - p->p3b;
+	p->va = p->p2a - p->p3a;
+	p->vb = p->p2b - p->p3b;
+	p->det = p->ua * p->vb - p->va * p->ub;
+}
+
+/* Project D onto the segment Q0 -> Q1, returning the parameter t
+	(0 = Q0, 1 = Q1) and the squared distance */
+template <typename FP> static inline FP exact_segment(FP da, FP db,
+	FP q0a, FP q0b, FP q1a, FP q1b, FP *t)
+{
+	FP ea = q1a - q0a;
+	FP eb = q1b - q0b;
+	FP len2 = ea * ea + eb * eb;
+
+	FP ct = static_cast<FP>(0.0);
+	if (len2 > static_cast<FP>(0.0))
+		ct = std::clamp(((da - q0a) * ea + (db - q0b) * eb) / len2,
+			static_cast<FP>(0.0), static_cast<FP>(1.0));
+
+	FP ra = q0a + ct * ea - da;
+	FP rb = q0b + ct * eb - db;
+
+	*t = ct;
+	return ra * ra + rb * rb;
+}
+
+/* Unconstrained solution, returns non-zero if it lies within the triangle */
+template <typename FP> static inline int exact_inside(const exact_params<FP> *p,
+	FP da, FP db, FP *x, FP *y, FP *z)
+{
+	if (p->det == static_cast<FP>(0.0))
+		return 0;
+
+	FP wa = da - p->p3a;
+	FP wb = db - p->p3b;
+
+	FP cx = (wa * p->vb - p->va * wb) / p->det;
+	FP cy = (p->ua * wb - wa * p->ub) / p->det;
+	FP cz = static_cast<FP>(1.0) - cx - cy;
+
+	*x = cx;
+	*y = cy;
+	*z = cz;
+
+	return cx >= static_cast<FP>(0.0) && cy >= static_cast<FP>(0.0) &&
+		cz >= static_cast<FP>(0.0);
+}
+
+template <typename FP> static inline void exact_solve(const exact_params<FP> *p,
+	FP da, FP db, FP *x, FP *y, FP *z)
+{
+	if (exact_inside(p, da, db, x, y, z))
+		return;
+
+	FP t;
+	FP best_x, best_y, best_z;
+
+	/* P2 -> P1, z = 0 */
+	FP best_err = exact_segment(da, db, p->p2a, p->p2b, p->p1a, p->p1b, &t);
+	best_x = t;
+	best_y = static_cast<FP>(1.0) - t;
+	best_z = static_cast<FP>(0.0);
+
+	/* P3 -> P2, x = 0 */
+	FP err = exact_segment(da, db, p->p3a, p->p3b, p->p2a, p->p2b, &t);
+	if (err < best_err)
+	{
+		best_err = err;
+		best_x = static_cast<FP>(0.0);
+		best_y = t;
+		best_z = static_cast<FP>(1.0) - t;
+	}
+
+	/* P1 -> P3, y = 0 */
+	err = exact_segment(da, db, p->p1a, p->p1b, p->p3a, p->p3b, &t);
+	if (err < best_err)
+	{
+		best_x = static_cast<FP>(1.0) - t;
+		best_y = static_cast<FP>(0.0);
+		best_z = t;
+	}
+
+	*x = best_x;
+	*y = best_y;
+	*z = best_z;
+}
+
+template <typename FP, typename OT> static inline OT exact_output(FP v, FP otype_max)
+{
+	v = std::clamp(v, static_cast<FP>(0.0), static_cast<FP>(1.0));
+	if (otype_max == static_cast<FP>(1.0))
+		return (OT)v;
+	return (OT)floor(v * otype_max);
+}
+
+template <typename FP, typename OT> static void exact_iter(
+	const int16_t *a, const int16_t *b,
+	float alphaa, float betaa, float gammaa,
+	float alphab, float betab, float gammab,
+	OT *x, OT *y, OT *z,
+	size_t pix_count,
+	int16_t *m,
+	float mr,
+	int idx_adjust,
+	FP otype_max,
+	int in_flip)
+{
+	exact_params<FP> p;
+	exact_init(&p, alphaa, betaa, gammaa, alphab, betab, gammab);
+
+#pragma omp parallel for
+	for (long long i = 0; i < (long long)pix_count; i++)
+	{
+		size_t idx = (size_t)i;
+
+		/* Clamp actual value to the max/min of the input values,
+			as per the cpu algorithm */
+		FP dA = std::clamp((FP)(a[idx] ^ in_flip), p.minA, p.maxA);
+		FP dB = std::clamp((FP)(b[idx] ^ in_flip), p.minB, p.maxB);
+
+		FP cx, cy, cz;
+		exact_solve(&p, dA, dB, &cx, &cy, &cz);
+
+		auto out_idx = idx;
+		if (idx_adjust)
+			out_idx = idx_adjust - idx;
+
+		x[out_idx] = exact_output<FP, OT>(cx, otype_max);
+		y[out_idx] = exact_output<FP, OT>(cy, otype_max);
+		z[out_idx] = exact_output<FP, OT>(cz, otype_max);
+
+		if (m)
+			m[out_idx] = (int16_t)((FP)(a[idx] ^ in_flip) * mr +
+				(FP)(b[idx] ^ in_flip) * (1.0 - mr));
+	}
+}
+
+template <typename FP> static int exact_dispatch(
+	const int16_t *a, const int16_t *b,
+	float alphaa, float betaa, float gammaa,
+	float alphab, float betab, float gammab,
+	void *x, void *y, void *z,
+	size_t pix_count,
+	int16_t *m,
+	float mr,
+	int idx_adjust,
+	libdect_output_type otype,
+	int in_flip)
+{
+	switch (otype)
+	{
+	case libdect_output_type::u8:
+		exact_iter<FP, uint8_t>(a, b, alphaa, betaa, gammaa,
+			alphab, betab, gammab,
+			(uint8_t*)x, (uint8_t*)y, (uint8_t*)z,
+			pix_count, m, mr, idx_adjust, static_cast<FP>(255.0), in_flip);
+		return 0;
+	case libdect_output_type::u16:
+		exact_iter<FP, uint16_t>(a, b, alphaa, betaa, gammaa,
+			alphab, betab, gammab,
+			(uint16_t*)x, (uint16_t*)y, (uint16_t*)z,
+			pix_count, m, mr, idx_adjust, static_cast<FP>(65535.0), in_flip);
+		return 0;
+	case libdect_output_type::f32:
+		exact_iter<FP, float>(a, b, alphaa, betaa, gammaa,
+			alphab, betab, gammab,
+			(float*)x, (float*)y, (float*)z,
+			pix_count, m, mr, idx_adjust, static_cast<FP>(1.0), in_flip);
+		return 0;
+	case libdect_output_type::f64:
+		exact_iter<FP, double>(a, b, alphaa, betaa, gammaa,
+			alphab, betab, gammab,
+			(double*)x, (double*)y, (double*)z,
+			pix_count, m, mr, idx_adjust, static_cast<FP>(1.0), in_flip);
+		return 0;
+	}
+
+	return -1;
+}
+
+int dect_algo_exact(int enhanced,
+	const int16_t *a, const int16_t *b,
+	float alphaa, float betaa, float gammaa,
+	float alphab, float betab, float gammab,
+	void *x, void *y, void *z,
+	size_t pix_count,
+	float min_step,
+	int16_t *m,
+	float mr,
+	int idx_adjust,
+	int use_single_fp,
+	libdect_output_type otype,
+	int in_flip)
+{
+	(void)enhanced;
+	(void)min_step;
+
+	if (use_single_fp)
+		return exact_dispatch<float>(a, b, alphaa, betaa, gammaa,
+			alphab, betab, gammab, x, y, z, pix_count,
+			m, mr, idx_adjust, otype, in_flip);
+	else
+		return exact_dispatch<double>(a, b, alphaa, betaa, gammaa,
+			alphab, betab, gammab, x, y, z, pix_count,
+			m, mr, idx_adjust, otype, in_flip);
+}
+
+/* Hybrid version of the cpu algorithm
+
+Most tissue voxels lie within the triangle, where the simultaneous
+equation solution is exact.  We therefore use that where we can and
+only run the iterative search (optionally deduplicated) on the
+remaining voxels, which are gathered into a contiguous list first.
+*/
+
+template <typename FP, typename OT> static int hybrid_iter(int enhanced,
+	const int16_t *a, const int16_t *b,
+	float alphaa, float betaa, float gammaa,
+	float alphab, float betab, float gammab,
+	OT *x, OT *y, OT *z,
+	size_t pix_count,
+	float min_step,
+	int16_t *m,
+	float mr,
+	int idx_adjust,
+	FP otype_max,
+	libdect_output_type otype,
+	int use_simd,
+	float warm_start,
+	int dedup_pairs,
+	size_t *unique_pairs,
+	size_t *fallback_count,
+	int in_flip)
+{
+	exact_params<FP> p;
+	exact_init(&p, alphaa, betaa, gammaa, alphab, betab, gammab);
+
+	std::vector<uint8_t> fallback(pix_count);
+
+#pragma omp parallel for
+	for (long long i = 0; i < (long long)pix_count; i++)
+	{
+		size_t idx = (size_t)i;
+
+		FP dA = std::clamp((FP)(a[idx] ^ in_flip), p.minA, p.maxA);
+		FP dB = std::clamp((FP)(b[idx] ^ in_flip), p.minB, p.maxB);
+
+		auto out_idx = idx;
+		if (idx_adjust)
+			out_idx = idx_adjust - idx;
+
+		FP cx, cy, cz;
+		if (exact_inside(&p, dA, dB, &cx, &cy, &cz))
+		{
+			x[out_idx] = exact_output<FP, OT>(cx, otype_max);
+			y[out_idx] = exact_output<FP, OT>(cy, otype_max);
+			z[out_idx] = exact_output<FP, OT>(cz, otype_max);
+			fallback[idx] = 0;
+		}
+		else
+			fallback[idx] = 1;
+
+		if (m)
+			m[out_idx] = (int16_t)((FP)(a[idx] ^ in_flip) * mr +
+				(FP)(b[idx] ^ in_flip) * (1.0 - mr));
+	}
+
+	auto keep = [&](size_t idx) { return fallback[idx] != 0; };
+	auto starts = compact_starts(pix_count, keep);
+	auto fb_count = starts.back();
+	if (fallback_count)
+		*fallback_count = fb_count;
+	if (unique_pairs)
+		*unique_pairs = 0;
+	if (fb_count == 0)
+		return 0;
+
+	std::vector<size_t> fb_idx(fb_count);
+	std::vector<int16_t> fa(fb_count), fb(fb_count);
+	std::vector<OT> fx(fb_count), fy(fb_count), fz(fb_count);
+
+	compact_pack(pix_count, starts, keep, [&](size_t idx, size_t out) {
+		fb_idx[out] = idx;
+		fa[out] = (int16_t)(a[idx] ^ in_flip);
+		fb[out] = (int16_t)(b[idx] ^ in_flip);
+	});
+
+	int ret;
+	if (dedup_pairs)
+		ret = dect_algo_dedup(enhanced, fa.data(), fb.data(),
+			alphaa, betaa, gammaa, alphab, betab, gammab,
+			fx.data(), fy.data(), fz.data(),
+			fb_count, min_step, NULL, 0.0f, 0, std::is_same<FP, float>::value,
+			otype, use_simd, warm_start, unique_pairs, 0);
+	else
+	{
+		cpu_iter_params p;
+		p.enhanced = enhanced;
+		p.a = fa.data();
+		p.b = fb.data();
+		p.alphaa = alphaa;
+		p.betaa = betaa;
+		p.gammaa = gammaa;
+		p.alphab = alphab;
+		p.betab = betab;
+		p.gammab = gammab;
+		p.x = fx.data();
+		p.y = fy.data();
+		p.z = fz.data();
+		p.pix_count = fb_count;
+		p.min_step = min_step;
+		p.use_single_fp = std::is_same<FP, float>::value;
+		p.otype = otype;
+		p.use_simd = use_simd;
+		p.warm_start = warm_start;
+
+		ret = dect_algo_cpu_iter(&p);
+	}
+	if (ret != 0)
+		return ret;
+
+#pragma omp parallel for
+	for (long long i = 0; i < (long long)fb_count; i++)
+	{
+		auto out_idx = fb_idx[i];
+		if (idx_adjust)
+			out_idx = idx_adjust - out_idx;
+
+		x[out_idx] = fx[i];
+		y[out_idx] = fy[i];
+		z[out_idx] = fz[i];
+	}
+
+	return 0;
+}
+
+template <typename FP> static int hybrid_dispatch(int enhanced,
+	const int16_t *a, const int16_t *b,
+	float alphaa, float betaa, float gammaa,
+	float alphab, float betab, float gammab,
+	void *x, void *y, void *z,
+	size_t pix_count,
+	float min_step,
+	int16_t *m,
+	float mr,
+	int idx_adjust,
+	libdect_output_type otype,
+	int use_simd,
+	float warm_start,
+	int dedup_pairs,
+	size_t *unique_pairs,
+	size_t *fallback_count,
+	int in_flip)
+{
+	switch (otype)
+	{
+	case libdect_output_type::u8:
+		return hybrid_iter<FP, uint8_t>(enhanced, a, b,
+			alphaa, betaa, gammaa, alphab, betab, gammab,
+			(uint8_t*)x, (uint8_t*)y, (uint8_t*)z,
+			pix_count, min_step, m, mr, idx_adjust,
+			static_cast<FP>(255.0), otype,
+			use_simd, warm_start, dedup_pairs, unique_pairs,
+			fallback_count, in_flip);
+	case libdect_output_type::u16:
+		return hybrid_iter<FP, uint16_t>(enhanced, a, b,
+			alphaa, betaa, gammaa, alphab, betab, gammab,
+			(uint16_t*)x, (uint16_t*)y, (uint16_t*)z,
+			pix_count, min_step, m, mr, idx_adjust,
+			static_cast<FP>(65535.0), otype,
+			use_simd, warm_start, dedup_pairs, unique_pairs,
+			fallback_count, in_flip);
+	case libdect_output_type::f32:
+		return hybrid_iter<FP, float>(enhanced, a, b,
+			alphaa, betaa, gammaa, alphab, betab, gammab,
+			(float*)x, (float*)y, (float*)z,
+			pix_count, min_step, m, mr, idx_adjust,
+			static_cast<FP>(1.0), otype,
+			use_simd, warm_start, dedup_pairs, unique_pairs,
+			fallback_count, in_flip);
+	case libdect_output_type::f64:
+		return hybrid_iter<FP, double>(enhanced, a, b,
+			alphaa, betaa, gammaa, alphab, betab, gammab,
+			(double*)x, (double*)y, (double*)z,
+			pix_count, min_step, m, mr, idx_adjust,
+			static_cast<FP>(1.0), otype,
+			use_simd, warm_start, dedup_pairs, unique_pairs,
+			fallback_count, in_flip);
+	}
+
+	return -1;
+}
+
+int dect_algo_hybrid(int enhanced,
+	const int16_t *a, const int16_t *b,
+	float alphaa, float betaa, float gammaa,
+	float alphab, float betab, float gammab,
+	void *x, void *y, void *z,
+	size_t pix_count,
+	float min_step,
+	int16_t *m,
+	float mr,
+	int idx_adjust,
+	int use_single_fp,
+	libdect_output_type otype,
+	int use_simd,
+	float warm_start,
+	int dedup_pairs,
+	size_t *unique_pairs,
+	size_t *fallback_count,
+	int in_flip)
+{
+	if (use_single_fp)
+		return hybrid_dispatch<float>(enhanced, a, b,
+			alphaa, betaa, gammaa, alphab, betab, gammab,
+			x, y, z, pix_count, min_step, m, mr, idx_adjust,
+			otype, use_simd, warm_start, dedup_pairs, unique_pairs,
+			fallback_count, in_flip);
+	else
+		return hybrid_dispatch<double>(enhanced, a, b,
+			alphaa, betaa, gammaa, alphab, betab, gammab,
+			x, y, z, pix_count, min_step, m, mr, idx_adjust,
+			otype, use_simd, warm_start, dedup_pairs, unique_pairs,
+			fallback_count, in_flip);
+}
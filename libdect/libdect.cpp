@@ -25,8 +25,16 @@
 
 #include <stdint.h>
 #include <string.h>
+#include <limits.h>
+#include <assert.h>
+#include <math.h>
 #include <iostream>
+#include <vector>
+#include <algorithm>
 #include "config.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #ifndef _MSC_VER
 #ifdef __GNUC__
 #define EXPORT __attribute__ ((visibility ("default")))
@@ -47,15 +55,54 @@ static const char *prettyversion = "v0.3";
 
 #define IN_LIBDECT
 #include "libdect.h"
+#include "cpu.h"
+
+struct opencl_context;
+struct lut_table;
+
+/* The device, settings and cached state that processing depends upon.
+	Contexts share nothing, so independent jobs can be run on different
+	contexts at the same time, but each context must only be used by one
+	thread at a time. */
+struct libdect_context
+{
+	int device_id = 0;
+	int enhanced = 1;
+	int use_single_fp = 0;
+	libdect_output_type otype = libdect_output_type::u8;
+	int dedup_pairs = 1;
+	int hybrid = 0;
+	int use_simd = 1;
+	float warm_start = 0.0f;
+	float slice_warm_start = 0.0f;
+	int simul = 0;
+	int unsigned_input = 0;
+	int use_lut = 0;
+	int use_exact = 0;
+	int max_threads = 0;
+	int program_cache = 1;
+	int specialize = 0;
+	int mask_below = INT16_MIN;
+	float mask_fill = 0.0f;
+	libdect_stats stats = {};
 
-static int _use_single_fp = 0;
-static libdect_output_type _otype = libdect_output_type::u8;
+	/* The last frame's solutions, for slice_warm_start */
+	std::vector<float> slice_field;
+	size_t slice_field_pix = 0;
+	int slice_field_enhanced = 0;
+
+	lut_table *lut = NULL;
+	opencl_context *ocl = NULL;
+};
+
+/* The context used by the functions which do not take one */
+static libdect_context _ctx;
 
 #if HAS_OPENCL
 int opencl_get_device_count();
 const char *opencl_get_device_name(int idx);
 
-int dect_algo_opencl(int enhanced,
+int dect_algo_opencl(opencl_context *ocl,
 	const int16_t *a, const int16_t *b,
 	float alphaa, float betaa, float gammaa,
 	float alphab, float betab, float gammab,
@@ -64,6 +111,32 @@ int dect_algo_opencl(int enhanced,
 	float min_step,
 	int16_t *m,
 	float mr,
+	int idx_adjust,
+	int simul,
+	int in_flip);
+
+int opencl_submit(opencl_context *ocl,
+	const int16_t *a, const int16_t *b,
+	float alphaa, float betaa, float gammaa,
+	float alphab, float betab, float gammab,
+	void *x, void *y, void *z,
+	size_t pix_count,
+	float min_step,
+	int16_t *m,
+	float mr,
+	int idx_adjust,
+	int simul,
+	int in_flip,
+	int *result,
+	size_t *ticket);
+int opencl_wait(opencl_context *ocl, size_t ticket);
+
+int opencl_reconstitute(opencl_context *ocl,
+	const void *x, const void *y, const void *z,
+	float alphaa, float betaa, float gammaa,
+	float alphab, float betab, float gammab,
+	int16_t *a, int16_t *b,
+	size_t pix_count,
 	int idx_adjust);
 #else
 int opencl_get_device_count()
@@ -108,79 +181,117 @@ EXPORT const char *dect_getVersion()
 	return vstr;
 }
 
-static int dect_algo_cpu_iter(int enhanced,
-	const int16_t * RESTRICT a, const int16_t * RESTRICT b,
+int dect_algo_simul(int enhanced,
+	const int16_t *a, const int16_t *b,
 	float alphaa, float betaa, float gammaa,
 	float alphab, float betab, float gammab,
-	void * RESTRICT x,
-	void * RESTRICT y,
-	void * RESTRICT z,
-	size_t outsize,
+	void *x, void *y, void *z,
+	size_t out_size,
 	float min_step,
-	int16_t * RESTRICT m,
+	int16_t *m,
 	float mr,
-	int idx_adjust);
+	int idx_adjust,
+	libdect_output_type otype,
+	int in_flip);
 
-/* Use to allow multiple cpu prototypes to be defined */
-#define CPU_PROTOTYPE(osig, otype)	int dect_algo_cpuf##osig##_iter(int enhanced, \
-	const int16_t * RESTRICT a, const int16_t * RESTRICT b, \
-	float alphaa, float betaa, float gammaa, \
-	float alphab, float betab, float gammab, \
-	otype * RESTRICT x, \
-	otype * RESTRICT y, \
-	otype * RESTRICT z, \
-	size_t outsize, \
-	float min_step, \
-	int16_t * RESTRICT m, \
-	float mr, \
-	int idx_adjust); \
-	\
-	int dect_algo_cpud##osig##_iter(int enhanced, \
-	const int16_t * RESTRICT a, const int16_t * RESTRICT b, \
-	float alphaa, float betaa, float gammaa, \
-	float alphab, float betab, float gammab, \
-	otype * RESTRICT x, \
-	otype * RESTRICT y, \
-	otype * RESTRICT z, \
-	size_t outsize, \
-	float min_step, \
-	int16_t * RESTRICT m, \
-	float mr, \
-	int idx_adjust);
+int dect_algo_reconstitute(
+	const void *x, const void *y, const void *z,
+	float alphaa, float betaa, float gammaa,
+	float alphab, float betab, float gammab,
+	int16_t *a, int16_t *b,
+	size_t pix_count,
+	int idx_adjust,
+	libdect_output_type otype,
+	const int16_t *orig_a, const int16_t *orig_b,
+	double *rms_a, double *rms_b);
+int dect_algo_reconstitute_rms(
+	const int16_t *a, const int16_t *b,
+	const int16_t *orig_a, const int16_t *orig_b,
+	size_t pix_count,
+	double *rms_a, double *rms_b);
 
-CPU_PROTOTYPE(8, uint8_t)
-CPU_PROTOTYPE(16, uint16_t)
-CPU_PROTOTYPE(f32, float)
-CPU_PROTOTYPE(f64, double)
+int dect_algo_lut(int enhanced,
+	const int16_t *a, const int16_t *b,
+	float alphaa, float betaa, float gammaa,
+	float alphab, float betab, float gammab,
+	void *x, void *y, void *z,
+	size_t pix_count,
+	float min_step,
+	int16_t *m,
+	float mr,
+	int idx_adjust,
+	int use_single_fp,
+	libdect_output_type otype,
+	int use_simd,
+	lut_table *lut,
+	int in_flip);
+lut_table *lut_create();
+void lut_destroy(lut_table *lut);
 
-int dect_algo_simul(int enhanced,
+int dect_algo_exact(int enhanced,
 	const int16_t *a, const int16_t *b,
 	float alphaa, float betaa, float gammaa,
 	float alphab, float betab, float gammab,
-	uint8_t *x, uint8_t *y, uint8_t *z,
-	size_t out_size,
+	void *x, void *y, void *z,
+	size_t pix_count,
 	float min_step,
 	int16_t *m,
 	float mr,
-	int idx_adjust);
+	int idx_adjust,
+	int use_single_fp,
+	libdect_output_type otype,
+	int in_flip);
+
+int dect_algo_hybrid(int enhanced,
+	const int16_t *a, const int16_t *b,
+	float alphaa, float betaa, float gammaa,
+	float alphab, float betab, float gammab,
+	void *x, void *y, void *z,
+	size_t pix_count,
+	float min_step,
+	int16_t *m,
+	float mr,
+	int idx_adjust,
+	int use_single_fp,
+	libdect_output_type otype,
+	int use_simd,
+	float warm_start,
+	int dedup_pairs,
+	size_t *unique_pairs,
+	size_t *fallback_count,
+	int in_flip);
 
 #if HAS_OPENCL
-int opencl_init(int platform, int enhanced,
-	int use_single_fp, libdect_output_type otype);
+opencl_context *opencl_create(int idx, int enhanced,
+	int use_single_fp, libdect_output_type otype, int use_cache,
+	int specialize);
+void opencl_destroy(opencl_context *ocl);
 #else
-int opencl_init(int platform, int enhanced,
-	int use_single_fp, libdect_output_type otype)
+opencl_context *opencl_create(int idx, int enhanced,
+	int use_single_fp, libdect_output_type otype, int use_cache,
+	int specialize)
 {
-	(void)platform;
+	(void)idx;
 	(void)enhanced;
 	(void)use_single_fp;
-	return -1;
+	(void)otype;
+	(void)use_cache;
+	(void)specialize;
+	return NULL;
+}
+
+void opencl_destroy(opencl_context *ocl)
+{
+	(void)ocl;
 }
 #endif
 
+/* Number of devices before the first OpenCL device */
+#define CPU_DEVICE_COUNT 2
+
 EXPORT int dect_getDeviceCount()
 {
-	return 2 + opencl_get_device_count();
+	return CPU_DEVICE_COUNT + opencl_get_device_count();
 }
 
 EXPORT const char *dect_getDeviceName(int idx)
@@ -192,106 +303,422 @@ EXPORT const char *dect_getDeviceName(int idx)
 	case 1:
 		return "CPU using simultaneous equations (fast but inaccurate)";
 	default:
-		return opencl_get_device_name(idx - 2);
+		return opencl_get_device_name(idx - CPU_DEVICE_COUNT);
+	}
+}
+
+/* Set up the device state of a context, releasing any it had before.
+	Invalid arguments leave the context as it was. */
+static int context_init(libdect_context *ctx, int idx, int enhanced,
+	int use_single_fp, libdect_output_type otype)
+{
+	if (idx < 0 || idx >= dect_getDeviceCount())
+	{
+		std::cerr << "ERROR: Unknown device ID" << std::endl;
+		return -1;
+	}
+	if (otype < libdect_output_type::u8 || otype > libdect_output_type::f64)
+	{
+		std::cerr << "ERROR: Unknown output type" << std::endl;
+		return -1;
+	}
+
+	opencl_destroy(ctx->ocl);
+	ctx->ocl = NULL;
+	lut_destroy(ctx->lut);
+	ctx->lut = lut_create();
+
+	std::vector<float>().swap(ctx->slice_field);
+	ctx->slice_field_pix = 0;
+
+	ctx->device_id = idx;
+	ctx->enhanced = enhanced;
+	ctx->use_single_fp = use_single_fp;
+	ctx->otype = otype;
+
+	/* Processing still falls back to the CPU if the device could not be
+		set up, but the caller is told */
+	if (idx >= CPU_DEVICE_COUNT)
+	{
+		ctx->ocl = opencl_create(idx - CPU_DEVICE_COUNT, enhanced,
+			use_single_fp, otype, ctx->program_cache, ctx->specialize);
+		if (!ctx->ocl)
+			return -1;
 	}
+	return 0;
+}
+
+static int context_set_option(libdect_context *ctx, libdect_option option,
+	double value)
+{
+	switch (option)
+	{
+	case libdect_option::dedup_pairs:
+		ctx->dedup_pairs = value != 0.0;
+		return 0;
+	case libdect_option::hybrid:
+		ctx->hybrid = value != 0.0;
+		return 0;
+	case libdect_option::simd:
+		ctx->use_simd = value != 0.0;
+		return 0;
+	case libdect_option::warm_start:
+		if (!(value >= 0.0))
+		{
+			std::cerr << "ERROR: Invalid warm start error" << std::endl;
+			return -1;
+		}
+		ctx->warm_start = (float)value;
+		return 0;
+	case libdect_option::slice_warm_start:
+		if (!(value >= 0.0))
+		{
+			std::cerr << "ERROR: Invalid warm start error" << std::endl;
+			return -1;
+		}
+		ctx->slice_warm_start = (float)value;
+		return 0;
+	case libdect_option::simul:
+		ctx->simul = value != 0.0;
+		return 0;
+	case libdect_option::unsigned_input:
+		ctx->unsigned_input = value != 0.0;
+		return 0;
+	case libdect_option::lookup_table:
+		ctx->use_lut = value != 0.0;
+		return 0;
+	case libdect_option::exact:
+		ctx->use_exact = value != 0.0;
+		return 0;
+	case libdect_option::max_threads:
+		if (value < 0.0)
+		{
+			std::cerr << "ERROR: Invalid thread count" << std::endl;
+			return -1;
+		}
+		ctx->max_threads = (int)value;
+		return 0;
+	case libdect_option::program_cache:
+		ctx->program_cache = value != 0.0;
+		return 0;
+	case libdect_option::specialize:
+		ctx->specialize = value != 0.0;
+		return 0;
+	case libdect_option::mask_below:
+		ctx->mask_below = (int)std::min(std::max(value, (double)INT16_MIN),
+			(double)INT16_MAX + 1.0);
+		return 0;
+	case libdect_option::mask_fill:
+		if (!(value >= 0.0 && value <= 1.0))
+		{
+			std::cerr << "ERROR: Invalid mask fill value" << std::endl;
+			return -1;
+		}
+		ctx->mask_fill = (float)value;
+		return 0;
+	}
+
+	std::cerr << "ERROR: Unknown option" << std::endl;
+	return -1;
 }
 
 EXPORT int dect_initDevice(int idx, int enhanced,
 	int use_single_fp, libdect_output_type otype)
 {
-	if (idx >= 2)
-		opencl_init(idx - 2, enhanced, use_single_fp,
-			otype);
-	_use_single_fp = use_single_fp;
-	_otype = otype;
+	return context_init(&_ctx, idx, enhanced, use_single_fp, otype);
+}
+
+EXPORT int dect_setOption(libdect_option option, double value)
+{
+	return context_set_option(&_ctx, option, value);
+}
+
+EXPORT int dect_getStats(libdect_stats *stats)
+{
+	if (!stats)
+		return -1;
+	*stats = _ctx.stats;
 	return 0;
 }
 
-static int dect_algo_cpu_iter(int enhanced,
+/* The voxels of a frame which are inside the mask, packed together so
+	that only they are processed, and where to put the results back */
+struct mask_frame
+{
+	std::vector<size_t> inside;
+	std::vector<int16_t> ca, cb, cm;
+	std::vector<uint8_t> cx, cy, cz;
+
+	const int16_t *a, *b;
+	void *x, *y, *z;
+	size_t pix_count;
+	int16_t *m;
+	float mr;
+	int idx_adjust;
+	int in_flip;
+	int merge_single_fp;
+};
+
+/* Whether a device starts each frame from the solutions of the last one.
+	Only the plain CPU search does, as the others reorder the voxels, so
+	it is used instead of dedup_pairs. */
+static int slice_warm_active(const libdect_context *ctx, int device_id)
+{
+	return ctx->slice_warm_start > 0.0f && device_id == 0 &&
+		!ctx->use_exact && !ctx->use_lut && !ctx->hybrid;
+}
+
+/* Whether the CPU search solves each distinct pair once */
+static int dedup_active(const libdect_context *ctx, int device_id)
+{
+	return ctx->dedup_pairs && !slice_warm_active(ctx, device_id);
+}
+
+/* Whether processing on a device packs the voxels inside the mask
+	together first.  The CPU search skips tiles outside the mask itself,
+	so it does not need to.  The mask only applies to the solvers, so the
+	simultaneous equations, on device 1 or with simul, ignore it. */
+static int mask_compacts(const libdect_context *ctx, int device_id)
+{
+	if (ctx->mask_below <= INT16_MIN || device_id == 1)
+		return 0;
+	if (device_id != 0)
+		return !ctx->simul;
+	return ctx->use_exact || ctx->use_lut || ctx->hybrid ||
+		dedup_active(ctx, device_id);
+}
+
+static inline int mask_inside(const libdect_context *ctx,
+	int16_t va, int16_t vb)
+{
+	return va >= ctx->mask_below || vb >= ctx->mask_below;
+}
+
+static size_t mask_gather(const libdect_context *ctx,
 	const int16_t *a, const int16_t *b,
-	float alphaa, float betaa, float gammaa,
-	float alphab, float betab, float gammab,
 	void *x, void *y, void *z,
 	size_t pix_count,
-	float min_step,
 	int16_t *m,
 	float mr,
-	int idx_adjust)
+	int idx_adjust,
+	int in_flip,
+	mask_frame *mf)
+{
+	mf->a = a;
+	mf->b = b;
+	mf->x = x;
+	mf->y = y;
+	mf->z = z;
+	mf->pix_count = pix_count;
+	mf->m = m;
+	mf->mr = mr;
+	mf->idx_adjust = idx_adjust;
+	mf->in_flip = in_flip;
+
+	/* The merged image outside the mask is made in the same precision as
+		the device would have */
+	mf->merge_single_fp = ctx->use_single_fp;
+
+	/* The packed copies are in the signed range, so they are processed
+		without in_flip */
+	auto keep = [&](size_t idx) {
+		return mask_inside(ctx, a[idx] ^ in_flip, b[idx] ^ in_flip);
+	};
+	auto starts = compact_starts(pix_count, keep);
+	auto count = starts.back();
+	mf->inside.resize(count);
+	mf->ca.resize(count);
+	mf->cb.resize(count);
+	compact_pack(pix_count, starts, keep, [&](size_t idx, size_t out) {
+		mf->inside[out] = idx;
+		mf->ca[out] = a[idx] ^ in_flip;
+		mf->cb[out] = b[idx] ^ in_flip;
+	});
+
+	auto osize = otype_size(ctx->otype);
+	mf->cx.resize(count * osize);
+	mf->cy.resize(count * osize);
+	mf->cz.resize(count * osize);
+	if (m)
+		mf->cm.resize(count);
+
+	return count;
+}
+
+template <typename FP, typename OT> static void mask_scatter_typed(
+	const mask_frame *mf, OT fill)
 {
-	if (_use_single_fp)
+	auto x = (OT *)mf->x;
+	auto y = (OT *)mf->y;
+	auto z = (OT *)mf->z;
+	auto cx = (const OT *)mf->cx.data();
+	auto cy = (const OT *)mf->cy.data();
+	auto cz = (const OT *)mf->cz.data();
+	auto a = mf->a;
+	auto b = mf->b;
+	auto m = mf->m;
+	auto in_flip = mf->in_flip;
+	FP mr = mf->mr;
+
+	/* Fill everything, as the CPU search does for voxels outside the
+		mask, then put back the voxels which were processed */
+#pragma omp parallel for
+	for (long long i = 0; i < (long long)mf->pix_count; i++)
 	{
-		switch(_otype)
-		{
-			case libdect_output_type::u16:
-				return dect_algo_cpuf16_iter(enhanced,
-					a, b, alphaa, betaa, gammaa,
-					alphab, betab, gammab,
-					(uint16_t*)x, (uint16_t*)y, (uint16_t*)z,
-					pix_count,
-					min_step, m, mr, idx_adjust);
-			case libdect_output_type::u8:
-				return dect_algo_cpuf8_iter(enhanced,
-					a, b, alphaa, betaa, gammaa,
-					alphab, betab, gammab,
-					(uint8_t*)x, (uint8_t*)y, (uint8_t*)z,
-					pix_count,
-					min_step, m, mr, idx_adjust);
-			case libdect_output_type::f32:
-				return dect_algo_cpuff32_iter(enhanced,
-					a, b, alphaa, betaa, gammaa,
-					alphab, betab, gammab,
-					(float*)x, (float*)y, (float*)z,
-					pix_count,
-					min_step, m, mr, idx_adjust);
-			case libdect_output_type::f64:
-				return dect_algo_cpuff64_iter(enhanced,
-					a, b, alphaa, betaa, gammaa,
-					alphab, betab, gammab,
-					(double*)x, (double*)y, (double*)z,
-					pix_count,
-					min_step, m, mr, idx_adjust);
-		}
+		size_t idx = (size_t)i;
+		auto out_idx = mf->idx_adjust ? (size_t)mf->idx_adjust - idx : idx;
+
+		x[out_idx] = fill;
+		y[out_idx] = fill;
+		z[out_idx] = fill;
+
+		if (m)
+			m[out_idx] = (int16_t)((FP)(a[idx] ^ in_flip) * mr +
+				(FP)(b[idx] ^ in_flip) * (1.0 - mr));
 	}
+
+#pragma omp parallel for
+	for (long long i = 0; i < (long long)mf->inside.size(); i++)
+	{
+		auto idx = mf->inside[i];
+		auto out_idx = mf->idx_adjust ? (size_t)mf->idx_adjust - idx : idx;
+
+		x[out_idx] = cx[i];
+		y[out_idx] = cy[i];
+		z[out_idx] = cz[i];
+
+		if (m)
+			m[out_idx] = mf->cm[i];
+	}
+}
+
+template <typename FP> static void mask_scatter_fp(const libdect_context *ctx,
+	const mask_frame *mf)
+{
+	auto fill = ctx->mask_fill;
+
+	switch (ctx->otype)
+	{
+	case libdect_output_type::u16:
+		mask_scatter_typed<FP, uint16_t>(mf, (uint16_t)floor(fill * 65535.0));
+		break;
+	case libdect_output_type::f32:
+		mask_scatter_typed<FP, float>(mf, fill);
+		break;
+	case libdect_output_type::f64:
+		mask_scatter_typed<FP, double>(mf, fill);
+		break;
+	default:
+		mask_scatter_typed<FP, uint8_t>(mf, (uint8_t)floor(fill * 255.0));
+		break;
+	}
+}
+
+static void mask_scatter(const libdect_context *ctx, const mask_frame *mf)
+{
+	if (mf->merge_single_fp)
+		mask_scatter_fp<float>(ctx, mf);
 	else
+		mask_scatter_fp<double>(ctx, mf);
+}
+
+/* The solutions of the last frame, which the search replaces with this
+	frame's.  They are kept while the frames are the same size. */
+static float *slice_field(libdect_context *ctx, int device_id, int enhanced,
+	size_t pix_count)
+{
+	if (!slice_warm_active(ctx, device_id))
+		return NULL;
+
+	if (ctx->slice_field_pix != pix_count ||
+		ctx->slice_field_enhanced != enhanced)
 	{
-		switch (_otype)
-		{
-			case libdect_output_type::u16:
-				return dect_algo_cpud16_iter(enhanced,
-					a, b, alphaa, betaa, gammaa,
-					alphab, betab, gammab,
-					(uint16_t*)x, (uint16_t*)y, (uint16_t*)z,
-					pix_count,
-					min_step, m, mr, idx_adjust);
-			case libdect_output_type::u8:
-				return dect_algo_cpud8_iter(enhanced,
-					a, b, alphaa, betaa, gammaa,
-					alphab, betab, gammab,
-					(uint8_t*)x, (uint8_t*)y, (uint8_t*)z,
-					pix_count,
-					min_step, m, mr, idx_adjust);
-			case libdect_output_type::f32:
-				return dect_algo_cpudf32_iter(enhanced,
-					a, b, alphaa, betaa, gammaa,
-					alphab, betab, gammab,
-					(float*)x, (float*)y, (float*)z,
-					pix_count,
-					min_step, m, mr, idx_adjust);
-			case libdect_output_type::f64:
-				return dect_algo_cpudf64_iter(enhanced,
-					a, b, alphaa, betaa, gammaa,
-					alphab, betab, gammab,
-					(double*)x, (double*)y, (double*)z,
-					pix_count,
-					min_step, m, mr, idx_adjust);
-		}
+		ctx->slice_field.assign(pix_count * 2 * enhanced, -1.0f);
+		ctx->slice_field_pix = pix_count;
+		ctx->slice_field_enhanced = enhanced;
 	}
+	return ctx->slice_field.data();
+}
 
-	/* Shouldn't get here */
-	return -1;
+/* What the algorithms XOR each input value with to bring it into the
+	signed range, for unsigned_input */
+static int input_flip(const libdect_context *ctx)
+{
+	return ctx->unsigned_input ? INT16_MIN : 0;
 }
 
-EXPORT int dect_process(
+/* The CPU search of a frame with the context's settings, without the
+	mask or warm starts */
+static cpu_iter_params context_cpu_params(const libdect_context *ctx,
+	int enhanced,
+	const int16_t *a, const int16_t *b,
+	float alphaa, float betaa, float gammaa,
+	float alphab, float betab, float gammab,
+	void *x, void *y, void *z,
+	size_t pix_count,
+	float min_step,
+	int16_t *m,
+	float mr,
+	int idx_adjust,
+	int in_flip)
+{
+	cpu_iter_params p;
+	p.enhanced = enhanced;
+	p.a = a;
+	p.b = b;
+	p.alphaa = alphaa;
+	p.betaa = betaa;
+	p.gammaa = gammaa;
+	p.alphab = alphab;
+	p.betab = betab;
+	p.gammab = gammab;
+	p.x = x;
+	p.y = y;
+	p.z = z;
+	p.pix_count = pix_count;
+	p.min_step = min_step;
+	p.m = m;
+	p.mr = mr;
+	p.idx_adjust = idx_adjust;
+	p.in_flip = in_flip;
+	p.use_single_fp = ctx->use_single_fp;
+	p.otype = ctx->otype;
+	p.use_simd = ctx->use_simd;
+	return p;
+}
+
+#if HAS_OPENCL
+/* Process a frame an OpenCL device failed on with the CPU algorithm it
+	stands in for */
+static int context_cpu_fallback(const libdect_context *ctx, int enhanced,
+	const int16_t *a, const int16_t *b,
+	float alphaa, float betaa, float gammaa,
+	float alphab, float betab, float gammab,
+	void *x, void *y, void *z,
+	size_t pix_count,
+	float min_step,
+	int16_t *m,
+	float mr,
+	int idx_adjust,
+	int in_flip)
+{
+	std::cerr << "ERROR: OpenCL algorithm failed, switching to CPU" << std::endl;
+
+	if (ctx->simul)
+		return dect_algo_simul(enhanced,
+			a, b, alphaa, betaa, gammaa,
+			alphab, betab, gammab, x, y, z, pix_count,
+			min_step, m, mr, idx_adjust, ctx->otype, in_flip);
+
+	auto p = context_cpu_params(ctx, enhanced,
+		a, b, alphaa, betaa, gammaa,
+		alphab, betab, gammab, x, y, z, pix_count,
+		min_step, m, mr, idx_adjust, in_flip);
+	return dect_algo_cpu_iter(&p);
+}
+#endif
+
+static int context_process_device(libdect_context *ctx,
 	int device_id, int enhanced,
 	const int16_t *a, const int16_t *b,
 	float alphaa, float betaa, float gammaa,
@@ -301,38 +728,83 @@ EXPORT int dect_process(
 	float min_step,
 	int16_t *m,
 	float mr,
-	int idx_adjust)
+	int idx_adjust,
+	int in_flip)
 {
+	ctx->stats.pix_count = pix_count;
+	ctx->stats.unique_pairs = 0;
+	ctx->stats.fallback_count = 0;
+
 	switch (device_id)
 	{
 	case 0:
-		return dect_algo_cpu_iter(enhanced,
-			a, b, alphaa, betaa, gammaa,
-			alphab, betab, gammab,
-			x, y, z,
-			pix_count,
-			min_step, m, mr, idx_adjust);
+		if (ctx->use_exact)
+			return dect_algo_exact(enhanced,
+				a, b, alphaa, betaa, gammaa,
+				alphab, betab, gammab, x, y, z, pix_count,
+				min_step, m, mr, idx_adjust, ctx->use_single_fp, ctx->otype,
+				in_flip);
+
+		if (ctx->use_lut)
+			return dect_algo_lut(enhanced,
+				a, b, alphaa, betaa, gammaa,
+				alphab, betab, gammab, x, y, z, pix_count,
+				min_step, m, mr, idx_adjust,
+				ctx->use_single_fp, ctx->otype, ctx->use_simd,
+				ctx->lut, in_flip);
+
+		if (ctx->hybrid)
+			return dect_algo_hybrid(enhanced,
+				a, b, alphaa, betaa, gammaa,
+				alphab, betab, gammab,
+				x, y, z,
+				pix_count,
+				min_step, m, mr, idx_adjust,
+				ctx->use_single_fp, ctx->otype, ctx->use_simd,
+				ctx->warm_start, ctx->dedup_pairs,
+				&ctx->stats.unique_pairs, &ctx->stats.fallback_count, in_flip);
+
+		if (dedup_active(ctx, device_id))
+			return dect_algo_dedup(enhanced,
+				a, b, alphaa, betaa, gammaa,
+				alphab, betab, gammab,
+				x, y, z,
+				pix_count,
+				min_step, m, mr, idx_adjust,
+				ctx->use_single_fp, ctx->otype, ctx->use_simd,
+				ctx->warm_start, &ctx->stats.unique_pairs,
+				in_flip);
+
+		{
+			auto p = context_cpu_params(ctx, enhanced,
+				a, b, alphaa, betaa, gammaa,
+				alphab, betab, gammab, x, y, z, pix_count,
+				min_step, m, mr, idx_adjust, in_flip);
+			p.mask_below = ctx->mask_below;
+			p.mask_fill = ctx->mask_fill;
+			p.warm_start = ctx->warm_start;
+			p.field = slice_field(ctx, device_id, enhanced, pix_count);
+			p.field_start = ctx->slice_warm_start;
+			return dect_algo_cpu_iter(&p);
+		}
 		
 	case 1:
 		return dect_algo_simul(enhanced,
 			a, b, alphaa, betaa, gammaa,
-			alphab, betab, gammab, (uint8_t*)x, (uint8_t*)y, (uint8_t*)z, pix_count,
-			min_step, m, mr, idx_adjust);
+			alphab, betab, gammab, x, y, z, pix_count,
+			min_step, m, mr, idx_adjust, ctx->otype, in_flip);
+
 	default:
 #if HAS_OPENCL
-		auto ret = dect_algo_opencl(enhanced,
+		auto ret = dect_algo_opencl(ctx->ocl,
 			a, b, alphaa, betaa, gammaa,
 			alphab, betab, gammab, x, y, z, pix_count,
-			min_step, m, mr, idx_adjust);
+			min_step, m, mr, idx_adjust, ctx->simul, in_flip);
 		if (ret != 0)
-		{
-			std::cerr << "ERROR: OpenCL algorithm failed, switching to CPU" << std::endl;
-
-			return dect_algo_cpu_iter(enhanced,
+			return context_cpu_fallback(ctx, enhanced,
 				a, b, alphaa, betaa, gammaa,
 				alphab, betab, gammab, x, y, z, pix_count,
-				min_step, m, mr, idx_adjust);
-		}
+				min_step, m, mr, idx_adjust, in_flip);
 		return ret;
 #else
 		std::cerr << "ERROR: Unknown device ID" << std::endl;
@@ -341,6 +813,478 @@ EXPORT int dect_process(
 	}
 }
 
+static int context_process(libdect_context *ctx,
+	int device_id, int enhanced,
+	const int16_t *a, const int16_t *b,
+	float alphaa, float betaa, float gammaa,
+	float alphab, float betab, float gammab,
+	void *x, void *y, void *z,
+	size_t pix_count,
+	float min_step,
+	int16_t *m,
+	float mr,
+	int idx_adjust)
+{
+	/* The thread limit only applies for the duration of the call, so
+		it does not change the caller's own OpenMP settings */
+#ifdef _OPENMP
+	int prev_threads = omp_get_max_threads();
+	if (ctx->max_threads > 0)
+		omp_set_num_threads(ctx->max_threads);
+#endif
+
+	int ret = 0;
+	if (mask_compacts(ctx, device_id))
+	{
+		mask_frame mf;
+		auto inside = mask_gather(ctx, a, b, x, y, z, pix_count,
+			m, mr, idx_adjust, input_flip(ctx), &mf);
+
+		ctx->stats = {};
+		if (inside)
+			ret = context_process_device(ctx, device_id, enhanced,
+				mf.ca.data(), mf.cb.data(), alphaa, betaa, gammaa,
+				alphab, betab, gammab,
+				mf.cx.data(), mf.cy.data(), mf.cz.data(), inside,
+				min_step, m ? mf.cm.data() : NULL, mr, 0, 0);
+		ctx->stats.pix_count = pix_count;
+
+		mask_scatter(ctx, &mf);
+	}
+	else
+		ret = context_process_device(ctx, device_id, enhanced,
+			a, b, alphaa, betaa, gammaa,
+			alphab, betab, gammab, x, y, z, pix_count,
+			min_step, m, mr, idx_adjust, input_flip(ctx));
+
+#ifdef _OPENMP
+	omp_set_num_threads(prev_threads);
+#endif
+
+	return ret;
+}
+
+struct libdect_job
+{
+	libdect_context *ctx;
+	int ret;
+	libdect_stats stats;
+
+	/* Set while an OpenCL frame is still queued */
+	int pending;
+	size_t ticket;
+
+	/* With a mask, the voxels inside it which were queued */
+	mask_frame *mask;
+
+	/* Kept so that a failed OpenCL frame can be redone on the CPU */
+	int enhanced;
+	const int16_t *a, *b;
+	float alphaa, betaa, gammaa;
+	float alphab, betab, gammab;
+	void *x, *y, *z;
+	size_t pix_count;
+	float min_step;
+	int16_t *m;
+	float mr;
+	int idx_adjust;
+	int in_flip;
+};
+
+static int context_process_async(libdect_context *ctx,
+	int device_id, int enhanced,
+	const int16_t *a, const int16_t *b,
+	float alphaa, float betaa, float gammaa,
+	float alphab, float betab, float gammab,
+	void *x, void *y, void *z,
+	size_t pix_count,
+	float min_step,
+	int16_t *m,
+	float mr,
+	int idx_adjust,
+	libdect_job **job)
+{
+	if (!job)
+		return -1;
+
+	auto j = new libdect_job();
+	j->ctx = ctx;
+	j->enhanced = enhanced;
+	j->a = a;
+	j->b = b;
+	j->alphaa = alphaa;
+	j->betaa = betaa;
+	j->gammaa = gammaa;
+	j->alphab = alphab;
+	j->betab = betab;
+	j->gammab = gammab;
+	j->x = x;
+	j->y = y;
+	j->z = z;
+	j->pix_count = pix_count;
+	j->min_step = min_step;
+	j->m = m;
+	j->mr = mr;
+	j->idx_adjust = idx_adjust;
+	j->in_flip = input_flip(ctx);
+	*job = j;
+
+#if HAS_OPENCL
+	if (device_id >= CPU_DEVICE_COUNT)
+	{
+		j->stats.pix_count = pix_count;
+
+		/* Only the voxels inside the mask are queued, and dect_wait
+			puts them back in place */
+		if (mask_compacts(ctx, device_id))
+		{
+			auto mf = new mask_frame();
+			j->mask = mf;
+			j->pix_count = mask_gather(ctx, a, b, x, y, z, pix_count,
+				m, mr, idx_adjust, j->in_flip, mf);
+			j->a = mf->ca.data();
+			j->b = mf->cb.data();
+			j->x = mf->cx.data();
+			j->y = mf->cy.data();
+			j->z = mf->cz.data();
+			j->m = m ? mf->cm.data() : NULL;
+			j->idx_adjust = 0;
+			j->in_flip = 0;
+		}
+
+		if (j->pix_count == 0)
+			return 0;
+
+		if (opencl_submit(ctx->ocl,
+			j->a, j->b, alphaa, betaa, gammaa,
+			alphab, betab, gammab, j->x, j->y, j->z, j->pix_count,
+			min_step, j->m, mr, j->idx_adjust, ctx->simul, j->in_flip,
+			&j->ret, &j->ticket) == 0)
+		{
+			j->pending = 1;
+			return 0;
+		}
+
+		delete j->mask;
+		j->mask = NULL;
+	}
+#endif
+
+	j->ret = context_process(ctx, device_id, enhanced,
+		a, b, alphaa, betaa, gammaa,
+		alphab, betab, gammab, x, y, z, pix_count,
+		min_step, m, mr, idx_adjust);
+	j->stats = ctx->stats;
+	return 0;
+}
+
+EXPORT int dect_wait(libdect_job *job)
+{
+	if (!job)
+		return -1;
+
+	auto ctx = job->ctx;
+
+#if HAS_OPENCL
+	if (job->pending)
+	{
+		opencl_wait(ctx->ocl, job->ticket);
+		if (job->ret != 0)
+			job->ret = context_cpu_fallback(ctx, job->enhanced,
+				job->a, job->b, job->alphaa, job->betaa, job->gammaa,
+				job->alphab, job->betab, job->gammab,
+				job->x, job->y, job->z, job->pix_count,
+				job->min_step, job->m, job->mr, job->idx_adjust, job->in_flip);
+	}
+#endif
+
+	if (job->mask)
+	{
+		mask_scatter(ctx, job->mask);
+		delete job->mask;
+	}
+
+	ctx->stats = job->stats;
+	auto ret = job->ret;
+	delete job;
+	return ret;
+}
+
+/* Voxels in each batch of whole slices a packed volume is split into
+	for OpenCL devices, so that the device buffers stay bounded while each
+	kernel still covers many slices */
+#define VOLUME_BATCH_PIX ((size_t)1 << 24)
+
+/* The same for the CPU devices, so that the packed copies and tables of
+	dedup_pairs, hybrid and the mask stay bounded however deep the
+	volume is */
+#define CPU_VOLUME_BATCH_PIX ((size_t)1 << 26)
+
+static int context_process_volume(libdect_context *ctx,
+	int device_id, int enhanced,
+	const int16_t *a, const int16_t *b,
+	float alphaa, float betaa, float gammaa,
+	float alphab, float betab, float gammab,
+	void *x, void *y, void *z,
+	size_t width, size_t height, size_t depth,
+	size_t row_stride, size_t slice_stride,
+	float min_step,
+	int16_t *m,
+	float mr,
+	int rotate)
+{
+	if (row_stride == 0)
+		row_stride = width;
+	if (slice_stride == 0)
+		slice_stride = row_stride * height;
+	if (row_stride < width || slice_stride < row_stride * height)
+	{
+		std::cerr << "ERROR: Invalid volume strides" << std::endl;
+		return -1;
+	}
+
+	auto slice_pix = width * height;
+	auto osize = otype_size(ctx->otype);
+
+	/* Rotation is by idx_adjust, which only reaches INT_MAX */
+	if (rotate && slice_pix > (size_t)INT_MAX)
+	{
+		std::cerr << "ERROR: Slices too large to rotate" << std::endl;
+		return -1;
+	}
+
+	/* Split the volume into pieces which are each contiguous: batches of
+		slices when it is packed, otherwise single slices, otherwise
+		single rows.  Rotation is within a slice, so it needs at least a
+		piece per slice. */
+	size_t piece_pix, rows_per_piece, slices_per_piece;
+	if (row_stride != width)
+	{
+		piece_pix = width;
+		rows_per_piece = 1;
+		slices_per_piece = 1;
+	}
+	else if (slice_stride != slice_pix || rotate)
+	{
+		piece_pix = slice_pix;
+		rows_per_piece = height;
+		slices_per_piece = 1;
+	}
+	else
+	{
+		auto batch_pix = device_id >= CPU_DEVICE_COUNT ?
+			VOLUME_BATCH_PIX : CPU_VOLUME_BATCH_PIX;
+		slices_per_piece = depth;
+		if (slice_pix)
+			slices_per_piece = std::max((size_t)1, batch_pix / slice_pix);
+		assert(slices_per_piece == 1 || slices_per_piece * slice_pix <= batch_pix);
+
+		/* Each slice starts from the one before it */
+		if (slice_warm_active(ctx, device_id))
+			slices_per_piece = 1;
+		piece_pix = 0;
+		rows_per_piece = height;
+	}
+
+	/* OpenCL pieces are queued as they are reached, so the transfers of
+		one overlap the kernel of another, and waited for at the end */
+	std::vector<libdect_job *> jobs;
+	for (size_t s = 0; s < depth; s += slices_per_piece)
+	{
+		for (size_t r = 0; r < height; r += rows_per_piece)
+		{
+			auto in_off = s * slice_stride + r * row_stride;
+			auto out_row = rotate ? height - rows_per_piece - r : r;
+			auto out_off = s * slice_stride + out_row * row_stride;
+			auto count = piece_pix ?
+				piece_pix : std::min(slices_per_piece, depth - s) * slice_pix;
+			if (count == 0)
+				continue;
+
+			libdect_job *job;
+			context_process_async(ctx, device_id, enhanced,
+				a + in_off, b + in_off, alphaa, betaa, gammaa,
+				alphab, betab, gammab,
+				(uint8_t *)x + out_off * osize,
+				(uint8_t *)y + out_off * osize,
+				(uint8_t *)z + out_off * osize,
+				count, min_step, m ? m + out_off : NULL, mr,
+				rotate ? (int)count - 1 : 0, &job);
+			jobs.push_back(job);
+		}
+	}
+
+	int ret = 0;
+	libdect_stats total = {};
+	for (auto it = jobs.begin(); it < jobs.end(); it++)
+	{
+		auto err = dect_wait(*it);
+		if (ret == 0)
+			ret = err;
+		total.pix_count += ctx->stats.pix_count;
+		total.unique_pairs += ctx->stats.unique_pairs;
+		total.fallback_count += ctx->stats.fallback_count;
+	}
+	ctx->stats = total;
+
+	return ret;
+}
+
+EXPORT int dect_process(
+	int device_id, int enhanced,
+	const int16_t *a, const int16_t *b,
+	float alphaa, float betaa, float gammaa,
+	float alphab, float betab, float gammab,
+	void *x, void *y, void *z,
+	size_t pix_count,
+	float min_step,
+	int16_t *m,
+	float mr,
+	int idx_adjust)
+{
+	return context_process(&_ctx, device_id, enhanced,
+		a, b, alphaa, betaa, gammaa,
+		alphab, betab, gammab, x, y, z,
+		pix_count, min_step, m, mr, idx_adjust);
+}
+
+EXPORT int dect_processAsync(
+	int device_id, int enhanced,
+	const int16_t *a, const int16_t *b,
+	float alphaa, float betaa, float gammaa,
+	float alphab, float betab, float gammab,
+	void *x, void *y, void *z,
+	size_t pix_count,
+	float min_step,
+	int16_t *m,
+	float mr,
+	int idx_adjust,
+	libdect_job **job)
+{
+	return context_process_async(&_ctx, device_id, enhanced,
+		a, b, alphaa, betaa, gammaa,
+		alphab, betab, gammab, x, y, z,
+		pix_count, min_step, m, mr, idx_adjust, job);
+}
+
+EXPORT int dect_processVolume(
+	int device_id, int enhanced,
+	const int16_t *a, const int16_t *b,
+	float alphaa, float betaa, float gammaa,
+	float alphab, float betab, float gammab,
+	void *x, void *y, void *z,
+	size_t width, size_t height, size_t depth,
+	size_t row_stride, size_t slice_stride,
+	float min_step,
+	int16_t *m,
+	float mr,
+	int rotate)
+{
+	return context_process_volume(&_ctx, device_id, enhanced,
+		a, b, alphaa, betaa, gammaa,
+		alphab, betab, gammab, x, y, z,
+		width, height, depth, row_stride, slice_stride,
+		min_step, m, mr, rotate);
+}
+
+EXPORT libdect_context *dect_createContext()
+{
+	return new libdect_context();
+}
+
+EXPORT void dect_destroyContext(libdect_context *ctx)
+{
+	if (!ctx)
+		return;
+	opencl_destroy(ctx->ocl);
+	lut_destroy(ctx->lut);
+	delete ctx;
+}
+
+EXPORT int dect_contextInitDevice(libdect_context *ctx, int idx, int enhanced,
+	int use_single_fp, libdect_output_type otype)
+{
+	if (!ctx)
+		return -1;
+	return context_init(ctx, idx, enhanced, use_single_fp, otype);
+}
+
+EXPORT int dect_contextSetOption(libdect_context *ctx, libdect_option option,
+	double value)
+{
+	if (!ctx)
+		return -1;
+	return context_set_option(ctx, option, value);
+}
+
+EXPORT int dect_contextGetStats(libdect_context *ctx, libdect_stats *stats)
+{
+	if (!ctx || !stats)
+		return -1;
+	*stats = ctx->stats;
+	return 0;
+}
+
+EXPORT int dect_contextProcess(libdect_context *ctx,
+	const int16_t *a, const int16_t *b,
+	float alphaa, float betaa, float gammaa,
+	float alphab, float betab, float gammab,
+	void *x, void *y, void *z,
+	size_t pix_count,
+	float min_step,
+	int16_t *m,
+	float mr,
+	int idx_adjust)
+{
+	if (!ctx)
+		return -1;
+	return context_process(ctx, ctx->device_id, ctx->enhanced,
+		a, b, alphaa, betaa, gammaa,
+		alphab, betab, gammab, x, y, z,
+		pix_count, min_step, m, mr, idx_adjust);
+}
+
+EXPORT int dect_contextProcessAsync(libdect_context *ctx,
+	const int16_t *a, const int16_t *b,
+	float alphaa, float betaa, float gammaa,
+	float alphab, float betab, float gammab,
+	void *x, void *y, void *z,
+	size_t pix_count,
+	float min_step,
+	int16_t *m,
+	float mr,
+	int idx_adjust,
+	libdect_job **job)
+{
+	if (!ctx)
+		return -1;
+	return context_process_async(ctx, ctx->device_id, ctx->enhanced,
+		a, b, alphaa, betaa, gammaa,
+		alphab, betab, gammab, x, y, z,
+		pix_count, min_step, m, mr, idx_adjust, job);
+}
+
+EXPORT int dect_contextProcessVolume(libdect_context *ctx,
+	const int16_t *a, const int16_t *b,
+	float alphaa, float betaa, float gammaa,
+	float alphab, float betab, float gammab,
+	void *x, void *y, void *z,
+	size_t width, size_t height, size_t depth,
+	size_t row_stride, size_t slice_stride,
+	float min_step,
+	int16_t *m,
+	float mr,
+	int rotate)
+{
+	if (!ctx)
+		return -1;
+	return context_process_volume(ctx, ctx->device_id, ctx->enhanced,
+		a, b, alphaa, betaa, gammaa,
+		alphab, betab, gammab, x, y, z,
+		width, height, depth, row_stride, slice_stride,
+		min_step, m, mr, rotate);
+}
+
 /* Create source images from processed images - for testing accuracy
 	of various algorithms */
 EXPORT int dect_reconstitute(
@@ -351,22 +1295,60 @@ EXPORT int dect_reconstitute(
 	size_t outsize,
 	int idx_adjust)
 {
-	for (size_t idx = 0; idx < outsize; idx++)
-	{
-		float curx = (float)x[idx] / 255.0f;
-		float cury = (float)y[idx] / 255.0f;
-		float curz = (float)z[idx] / 255.0f;
-		
-		float cura = curx * alphaa + cury * betaa + curz * gammaa;
-		float curb = curx * alphab + cury * betab + curz * gammab;
+	return dect_algo_reconstitute(x, y, z,
+		alphaa, betaa, gammaa, alphab, betab, gammab,
+		a, b, outsize, idx_adjust, libdect_output_type::u8,
+		NULL, NULL, NULL, NULL);
+}
 
-		auto out_idx = idx;
-		if (idx_adjust)
-			out_idx = idx_adjust - idx;
+/* As dect_reconstitute, for x, y and z in the context's output type, on its
+	OpenCL device if it has one.  With orig_a and orig_b, the images x, y
+	and z were made from, the RMS differences from them are returned in
+	rms_a and rms_b */
+EXPORT int dect_contextReconstitute(libdect_context *ctx,
+	const void *x, const void *y, const void *z,
+	float alphaa, float betaa, float gammaa,
+	float alphab, float betab, float gammab,
+	int16_t *a, int16_t *b,
+	size_t outsize,
+	int idx_adjust,
+	const int16_t *orig_a, const int16_t *orig_b,
+	double *rms_a, double *rms_b)
+{
+	if (!ctx)
+		return -1;
+
+#ifdef _OPENMP
+	int prev_threads = omp_get_max_threads();
+	if (ctx->max_threads > 0)
+		omp_set_num_threads(ctx->max_threads);
+#endif
 
-		a[out_idx] = (int16_t)cura;
-		b[out_idx] = (int16_t)curb;
+	int ret = -1;
+
+#if HAS_OPENCL
+	if (ctx->device_id >= CPU_DEVICE_COUNT && ctx->ocl)
+	{
+		ret = opencl_reconstitute(ctx->ocl, x, y, z,
+			alphaa, betaa, gammaa, alphab, betab, gammab,
+			a, b, outsize, idx_adjust);
+		if (ret == 0 && orig_a && orig_b)
+			dect_algo_reconstitute_rms(a, b, orig_a, orig_b, outsize,
+				rms_a, rms_b);
+		else if (ret != 0)
+			std::cerr << "ERROR: OpenCL algorithm failed, switching to CPU" << std::endl;
 	}
+#endif
 
-	return 0;
+	if (ret != 0)
+		ret = dect_algo_reconstitute(x, y, z,
+			alphaa, betaa, gammaa, alphab, betab, gammab,
+			a, b, outsize, idx_adjust, ctx->otype,
+			orig_a, orig_b, rms_a, rms_b);
+
+#ifdef _OPENMP
+	omp_set_num_threads(prev_threads);
+#endif
+
+	return ret;
 }
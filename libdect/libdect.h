@@ -25,19 +25,120 @@
 #define LIBDECT_H
 
 #include <stdint.h>
+#include <stddef.h>
 
 enum libdect_output_type
 {
 	u8, u16, f32, f64
 };
 
+enum class libdect_option
+{
+	/* CPU device: solve each distinct clamped (a, b) pair only
+		once per frame.  Ignored with slice_warm_start (default 1) */
+	dedup_pairs,
+
+	/* CPU device: use the exact simultaneous equation solution where
+		it lies within the valid range and only search for the rest
+		(default 0) */
+	hybrid,
+
+	/* CPU device: search several voxels at once with SIMD
+		instructions, chosen at runtime for the current processor
+		(default 1) */
+	simd,
+
+	/* CPU devices: the most threads to use for processing, 0 to use
+		the OpenMP default (default 0) */
+	max_threads,
+
+	/* OpenCL devices: keep compiled programs on disk, in DECT_CACHE_DIR
+		or the user's cache directory, and reuse them while the device,
+		driver and kernel source are unchanged.  Read by dect_initDevice
+		and dect_contextInitDevice (default 1) */
+	program_cache,
+
+	/* OpenCL devices: build kernels with the densities and min_step
+		baked in, precomputing the coarse search, the first time each set
+		of them is processed.  Read by dect_initDevice and
+		dect_contextInitDevice (default 0) */
+	specialize,
+
+	/* Voxels where both A and B are below this value, such as the air
+		around the patient, are outside the mask: they are not solved
+		and x, y and z get mask_fill instead.  The merged image is still
+		made for them.  Only the solvers use the mask; device 1 and the
+		simul option solve every voxel (default -32768, i.e. no mask) */
+	mask_below,
+
+	/* The fraction of the output range given to x, y and z outside the
+		mask, from 0 to 1 (default 0) */
+	mask_fill,
+
+	/* CPU device: skip the coarse grid where the previous voxel's
+		solution, usually its neighbour in the row, has at most this error
+		in HU, and refine from there instead.  0 to always use the grid
+		(default 0) */
+	warm_start,
+
+	/* CPU device without hybrid: keep every voxel's solution and start
+		the same voxel of the next frame of the same size from it, as for
+		consecutive slices, where its error there is at most this many HU.
+		Otherwise the previous voxel or the coarse grid is used as usual.
+		Every voxel is solved, as if dedup_pairs were 0.
+		dect_processVolume then goes a slice at a time, and initializing
+		the device forgets the last frame.  0 to not keep them
+		(default 0) */
+	slice_warm_start,
+
+	/* OpenCL devices: solve with the simultaneous equations, as device 1
+		does, rather than searching.  Fast but inaccurate (default 0) */
+	simul,
+
+	/* A and B hold unsigned values offset by 32768, as 16 bit CT images
+		are often stored, rather than signed HU.  They are moved into the
+		signed range as they are read, so the buffers can come straight
+		from the file.  mask_below and m are in the signed range
+		(default 0) */
+	unsigned_input,
+
+	/* CPU device: solve every clamped (a, b) pair the densities allow
+		once, on the first frame after they or the settings change, and
+		then look each voxel up.  Takes precedence over dedup_pairs and
+		hybrid (default 0) */
+	lookup_table,
+
+	/* CPU device: find the exact least squares solution within the valid
+		range directly rather than searching, so min_step does not apply.
+		Takes precedence over the other CPU device options (default 0) */
+	exact
+};
+
+struct libdect_stats
+{
+	size_t pix_count;		/* voxels in the last frame */
+	size_t unique_pairs;	/* distinct (a, b) pairs solved, 0 if not deduplicated */
+	size_t fallback_count;	/* hybrid: voxels that needed the iterative search */
+};
+
+/* A frame queued by dect_processAsync, to be passed to dect_wait */
+struct libdect_job;
+
+/* A device with its settings and cached state, from dect_createContext */
+struct libdect_context;
+
 #ifndef IN_LIBDECT
 int dect_getDeviceCount();
 const char *dect_getVersion();
 const char *dect_getDeviceName(int idx);
 int dect_initDevice(int idx, int enhanced, int use_single_fp,
 	libdect_output_type otype);
+int dect_setOption(libdect_option option, double value);
+int dect_getStats(libdect_stats *stats);
 
+/* A nonzero idx_adjust writes voxel idx of x, y, z and the merged image m
+	to idx_adjust - idx, so pix_count - 1 turns the frame 180 degrees, as
+	the CLI's -F. */
 int dect_process(
 	int device_id,
 	int enhanced,
@@ -51,6 +152,102 @@ int dect_process(
 	float mr,
 	int idx_adjust);
 
+/* As dect_process, but OpenCL devices return once the frame is queued so
+	that it runs alongside the caller and the next frame's upload.  Other
+	devices process the frame before returning.  The buffers must stay
+	valid until dect_wait, which must be called exactly once per job from
+	the submitting thread.  It returns the frame's status, and afterwards
+	dect_getStats reports that frame. */
+int dect_processAsync(
+	int device_id,
+	int enhanced,
+	const int16_t *a, const int16_t *b,
+	float alphaa, float betaa, float gammaa,
+	float alphab, float betab, float gammab,
+	void *x, void *y, void *z,
+	size_t pix_count,
+	float min_step,
+	int16_t *m,
+	float mr,
+	int idx_adjust,
+	libdect_job **job);
+int dect_wait(libdect_job *job);
+
+/* Process a stack of depth slices, each of height rows of width voxels,
+	in one call.  Strides are in voxels and apply to every buffer, with 0
+	meaning tightly packed.  A packed volume is processed in batches of
+	many slices, with more to a batch on CPU devices.  rotate
+	turns each slice of x, y, z and m 180 degrees, as the CLI's -F.
+	dect_getStats reports the totals for the volume. */
+int dect_processVolume(
+	int device_id,
+	int enhanced,
+	const int16_t *a, const int16_t *b,
+	float alphaa, float betaa, float gammaa,
+	float alphab, float betab, float gammab,
+	void *x, void *y, void *z,
+	size_t width, size_t height, size_t depth,
+	size_t row_stride, size_t slice_stride,
+	float min_step,
+	int16_t *m,
+	float mr,
+	int rotate);
+
+/* Contexts hold everything the functions above keep globally: the
+	device, precision, output type, options, statistics and the device's
+	buffers and programs.  Contexts share nothing, so different threads can
+	each process with their own context at the same time, although one
+	context must only be used by one thread at a time.  The functions
+	without a context use a single context of their own.  A new context
+	has the default options, and needs dect_contextInitDevice before it is
+	used.  Processing uses the context's device and enhanced mode, and
+	jobs from dect_contextProcessAsync are finished with dect_wait. */
+libdect_context *dect_createContext();
+void dect_destroyContext(libdect_context *ctx);
+int dect_contextInitDevice(libdect_context *ctx, int idx, int enhanced,
+	int use_single_fp, libdect_output_type otype);
+int dect_contextSetOption(libdect_context *ctx, libdect_option option,
+	double value);
+int dect_contextGetStats(libdect_context *ctx, libdect_stats *stats);
+
+int dect_contextProcess(
+	libdect_context *ctx,
+	const int16_t *a, const int16_t *b,
+	float alphaa, float betaa, float gammaa,
+	float alphab, float betab, float gammab,
+	void *x, void *y, void *z,
+	size_t pix_count,
+	float min_step,
+	int16_t *m,
+	float mr,
+	int idx_adjust);
+
+int dect_contextProcessAsync(
+	libdect_context *ctx,
+	const int16_t *a, const int16_t *b,
+	float alphaa, float betaa, float gammaa,
+	float alphab, float betab, float gammab,
+	void *x, void *y, void *z,
+	size_t pix_count,
+	float min_step,
+	int16_t *m,
+	float mr,
+	int idx_adjust,
+	libdect_job **job);
+
+int dect_contextProcessVolume(
+	libdect_context *ctx,
+	const int16_t *a, const int16_t *b,
+	float alphaa, float betaa, float gammaa,
+	float alphab, float betab, float gammab,
+	void *x, void *y, void *z,
+	size_t width, size_t height, size_t depth,
+	size_t row_stride, size_t slice_stride,
+	float min_step,
+	int16_t *m,
+	float mr,
+	int rotate);
+
 int dect_reconstitute(
 	const uint8_t *x, const uint8_t *y, const uint8_t *z,
 	float alphaa, float betaa, float gammaa,
@@ -59,6 +256,22 @@ int dect_reconstitute(
 	size_t outsize,
 	int idx_adjust);
 
+/* Work out the A and B images that x, y and z, in the context's output
+	type, were made from, on its device.  Given the original orig_a and
+	orig_b it also returns how far a and b are from them, as RMS HU in
+	rms_a and rms_b, without another pass over the images.  Either may be
+	NULL; without the originals they are left alone. */
+int dect_contextReconstitute(
+	libdect_context *ctx,
+	const void *x, const void *y, const void *z,
+	float alphaa, float betaa, float gammaa,
+	float alphab, float betab, float gammab,
+	int16_t *a, int16_t *b,
+	size_t outsize,
+	int idx_adjust,
+	const int16_t *orig_a, const int16_t *orig_b,
+	double *rms_a, double *rms_b);
+
 #endif
 
 #endif
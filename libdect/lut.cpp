@@ -0,0 +1,218 @@
+/* Copyright (C) 2016-2020 by John Cronin
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#include <stdint.h>
+#include <math.h>
+#include <stddef.h>
+#include <algorithm>
+#include <vector>
+
+#define IN_LIBDECT
+#include "libdect.h"
+#include "cpu.h"
+
+/* Lookup table version of the cpu algorithm
+
+The cpu algorithm clamps each input voxel to the range of the
+material densities before searching, so its result depends only
+on the clamped pair (a, b).  As the inputs are int16_t, there are
+at most (maxA - minA + 1) * (maxB - minB + 1) distinct pairs
+(about 1500 x 1400 with the default densities).
+
+We therefore run the cpu algorithm once over every possible pair,
+storing x, y and z in the current output type, and then each frame
+is simply a gather from the table.
+
+Each context has its own table, which is rebuilt on the next frame
+if any of the parameters it depends upon have changed.  Frame inputs
+are XORed with in_flip as they are read, as in the cpu algorithm.
+*/
+
+struct lut_table
+{
+	int valid;
+
+	int enhanced;
+	float alphaa, betaa, gammaa;
+	float alphab, betab, gammab;
+	float min_step;
+	int use_single_fp;
+	libdect_output_type otype;
+
+	int lo_a, hi_a, lo_b, hi_b;
+	size_t width;
+
+	std::vector<uint8_t> x, y, z;
+};
+
+lut_table *lut_create()
+{
+	auto lut = new lut_table();
+	lut->valid = 0;
+	return lut;
+}
+
+void lut_destroy(lut_table *lut)
+{
+	delete lut;
+}
+
+static int lut_build(lut_table *lut, int enhanced,
+	float alphaa, float betaa, float gammaa,
+	float alphab, float betab, float gammab,
+	float min_step,
+	int use_single_fp,
+	libdect_output_type otype,
+	int use_simd)
+{
+	if (lut->valid &&
+		lut->enhanced == enhanced &&
+		lut->alphaa == alphaa && lut->betaa == betaa && lut->gammaa == gammaa &&
+		lut->alphab == alphab && lut->betab == betab && lut->gammab == gammab &&
+		lut->min_step == min_step &&
+		lut->use_single_fp == use_single_fp &&
+		lut->otype == otype)
+		return 0;
+
+	lut->valid = 0;
+
+	clamped_range(alphaa, betaa, gammaa, &lut->lo_a, &lut->hi_a);
+	clamped_range(alphab, betab, gammab, &lut->lo_b, &lut->hi_b);
+
+	lut->width = (size_t)(lut->hi_a - lut->lo_a + 1);
+	size_t entries = lut->width * (size_t)(lut->hi_b - lut->lo_b + 1);
+
+	std::vector<int16_t> ta(entries), tb(entries);
+
+#pragma omp parallel for
+	for (long long i = 0; i < (long long)entries; i++)
+	{
+		ta[i] = (int16_t)(lut->lo_a + (int)(i % lut->width));
+		tb[i] = (int16_t)(lut->lo_b + (int)(i / lut->width));
+	}
+
+	auto esize = otype_size(otype);
+	lut->x.resize(entries * esize);
+	lut->y.resize(entries * esize);
+	lut->z.resize(entries * esize);
+
+	cpu_iter_params p;
+	p.enhanced = enhanced;
+	p.a = ta.data();
+	p.b = tb.data();
+	p.alphaa = alphaa;
+	p.betaa = betaa;
+	p.gammaa = gammaa;
+	p.alphab = alphab;
+	p.betab = betab;
+	p.gammab = gammab;
+	p.x = lut->x.data();
+	p.y = lut->y.data();
+	p.z = lut->z.data();
+	p.pix_count = entries;
+	p.min_step = min_step;
+	p.use_single_fp = use_single_fp;
+	p.otype = otype;
+	p.use_simd = use_simd;
+
+	auto ret = dect_algo_cpu_iter(&p);
+	if (ret != 0)
+		return ret;
+
+	lut->enhanced = enhanced;
+	lut->alphaa = alphaa;
+	lut->betaa = betaa;
+	lut->gammaa = gammaa;
+	lut->alphab = alphab;
+	lut->betab = betab;
+	lut->gammab = gammab;
+	lut->min_step = min_step;
+	lut->use_single_fp = use_single_fp;
+	lut->otype = otype;
+	lut->valid = 1;
+
+	return 0;
+}
+
+template <typename FP, typename T> static void lut_gather(const lut_table *lut,
+	const int16_t *a, const int16_t *b,
+	T *x, T *y, T *z,
+	size_t pix_count,
+	int16_t *m,
+	FP mr,
+	int idx_adjust,
+	int in_flip)
+{
+	const T *tx = (const T *)lut->x.data();
+	const T *ty = (const T *)lut->y.data();
+	const T *tz = (const T *)lut->z.data();
+
+#pragma omp parallel for
+	for (long long i = 0; i < (long long)pix_count; i++)
+	{
+		size_t idx = (size_t)i;
+
+		int ia = std::clamp(a[idx] ^ in_flip, lut->lo_a, lut->hi_a) - lut->lo_a;
+		int ib = std::clamp(b[idx] ^ in_flip, lut->lo_b, lut->hi_b) - lut->lo_b;
+		size_t tidx = (size_t)ib * lut->width + (size_t)ia;
+
+		auto out_idx = idx;
+		if (idx_adjust)
+			out_idx = idx_adjust - idx;
+
+		x[out_idx] = tx[tidx];
+		y[out_idx] = ty[tidx];
+		z[out_idx] = tz[tidx];
+
+		if (m)
+			m[out_idx] = (int16_t)((FP)(a[idx] ^ in_flip) * mr +
+				(FP)(b[idx] ^ in_flip) * (1.0 - mr));
+	}
+}
+
+int dect_algo_lut(int enhanced,
+	const int16_t *a, const int16_t *b,
+	float alphaa, float betaa, float gammaa,
+	float alphab, float betab, float gammab,
+	void *x, void *y, void *z,
+	size_t pix_count,
+	float min_step,
+	int16_t *m,
+	float mr,
+	int idx_adjust,
+	int use_single_fp,
+	libdect_output_type otype,
+	int use_simd,
+	lut_table *lut,
+	int in_flip)
+{
+	auto ret = lut_build(lut, enhanced, alphaa, betaa, gammaa,
+		alphab, betab, gammab, min_step, use_single_fp, otype, use_simd);
+	if (ret != 0)
+		return ret;
+
+	return cpu_type_dispatch(use_single_fp, otype, [&](auto *fp, auto *ot) {
+		typedef std::remove_pointer_t<decltype(fp)> FP;
+		typedef std::remove_pointer_t<decltype(ot)> OT;
+		lut_gather<FP>(lut, a, b, (OT *)x, (OT *)y, (OT *)z,
+			pix_count, m, (FP)mr, idx_adjust, in_flip);
+	});
+}
@@ -20,7 +20,9 @@
 */
 
 #include <stdio.h>
+#include <string.h>
 #include <utility>
+#include <algorithm>
 
 #define CL_HPP_ENABLE_PROGRAM_CONSTRUCTION_FROM_ARRAY_COMPATIBILITY
 #include "opencl.hpp"
@@ -32,6 +34,9 @@
 #include <string>
 #include <iterator>
 #include <sstream>
+#include <filesystem>
+#include <map>
+#include <tuple>
 
 #ifdef _MSC_VER
 #include <tchar.h>
@@ -42,17 +47,91 @@
 
 #define IN_LIBDECT
 #include "libdect.h"
+#include "cpu.h"
 
-static cl::Context *context;
-static cl::Program *program;
-static cl::Kernel *kernel;
-static cl::CommandQueue *queue;
-static cl::Device device;
-static std::vector<cl::Device> devices;
 
-static int is_init = 0;
-static int use_double = 1;
-static libdect_output_type _otype = libdect_output_type::u8;
+/* Frames which may be in flight at once.  Each slot has its own in-order
+	queue, so one frame's transfers overlap the kernel of the other. */
+#define OPENCL_SLOTS 2
+
+/* Device buffers and page-locked host staging are kept across frames and
+	only reallocated when a larger frame arrives.  The staging buffers are
+	mapped once, so their host pointers can be used for every transfer. */
+struct opencl_slot
+{
+	cl::CommandQueue queue;
+	cl::Buffer ina, inb, outx, outy, outz, outm;
+	cl::Buffer pin_in, pin_out;
+	uint8_t *host_in;
+	uint8_t *host_out;
+	size_t buf_pix_count;
+
+	/* The frame submitted to this slot, while its results have not yet
+		been copied out */
+	size_t ticket;
+	int *result;
+	cl::Event start, done;
+	void *x, *y, *z;
+	int16_t *m;
+	size_t pix_count;
+};
+
+/* What a specialized kernel is built for */
+struct opencl_special_key
+{
+	float alphaa, betaa, gammaa;
+	float alphab, betab, gammab;
+	float min_step;
+	int use_double;
+
+	bool operator<(const opencl_special_key &o) const
+	{
+		return std::tie(alphaa, betaa, gammaa, alphab, betab, gammab,
+			min_step, use_double) <
+			std::tie(o.alphaa, o.betaa, o.gammaa, o.alphab, o.betab, o.gammab,
+				o.min_step, o.use_double);
+	}
+};
+
+/* A device in use, with its own context and program.  Each frame is split
+	between the devices in use in proportion to their measured rates. */
+struct opencl_dev
+{
+	cl::Device device;
+	cl::Context context;
+	cl::Program program;
+	cl::Kernel kernel;
+	cl::Kernel simul_kernel;
+	cl::Kernel reconstitute_kernel;
+	cl::Kernel coarse_kernel;
+	int use_double;
+
+	int enhanced;
+	libdect_output_type otype;
+	int use_cache;
+	int specialize;
+
+	double rate;	/* voxels per second, once timed */
+	int timed;
+
+	/* Kernels specialized for particular densities and min_step */
+	std::map<opencl_special_key, cl::Kernel> special;
+
+	opencl_slot slots[OPENCL_SLOTS];
+};
+
+/* The devices of one libdect context.  Contexts share nothing, so each
+	can be used from its own thread. */
+struct opencl_context
+{
+	std::vector<opencl_dev *> devs;
+	size_t next_ticket;
+};
+
+/* Compiled programs are kept on disk so that later runs can skip the
+	compiler.  Each file is named by a hash of everything which affects the
+	build, and starts with the full key, which is checked when loading. */
+#define PROGRAM_CACHE_MAGIC "DECTBIN1"
 
 #define checkErr(err, name) \
 	if ((err) != CL_SUCCESS) { \
@@ -67,218 +146,669 @@ static libdect_output_type _otype = libdect_output_type::u8;
 	} \
 
 
-int opencl_dump_platforms()
+/* Every device of every platform, in the order they are numbered */
+static std::vector<cl::Device> get_all_devices()
 {
-	std::vector< cl::Platform > platformList;
+	std::vector<cl::Device> ret;
+	std::vector<cl::Platform> platformList;
 	cl::Platform::get(&platformList);
-	checkErr(platformList.size() != 0 ? CL_SUCCESS : -1, "cl::Platform::get");
-	//std::cerr << "Platform number is: " << platformList.size() << std::endl;
 
-	int id = 2;
-	for (auto it = platformList.begin(); it < platformList.end(); it++, id++)
+	for (auto it = platformList.begin(); it < platformList.end(); it++)
 	{
-		std::string platformVendor;
-		std::string platformName;
-		it->getInfo((cl_platform_info)CL_PLATFORM_VENDOR, &platformVendor);
-		it->getInfo((cl_platform_info)CL_PLATFORM_NAME, &platformName);
-		std::cout << " " << id << ": OpenCL " << platformName << " (" << platformVendor << ")" << std::endl;
+		std::vector<cl::Device> platformDevices;
+		if (it->getDevices(CL_DEVICE_TYPE_ALL, &platformDevices) == CL_SUCCESS)
+			ret.insert(ret.end(), platformDevices.begin(), platformDevices.end());
 	}
 
-	return 0;
+	return ret;
 }
 
+/* With more than one device, an extra last entry uses them all */
 int opencl_get_device_count()
 {
-	std::vector< cl::Platform > platformList;
-	cl::Platform::get(&platformList);
-	return static_cast<int>(platformList.size());
+	auto count = static_cast<int>(get_all_devices().size());
+	return count > 1 ? count + 1 : count;
 }
 
 const char *opencl_get_device_name(int idx)
 {
-	std::vector< cl::Platform > platformList;
-	cl::Platform::get(&platformList);
-	checkErr2(platformList.size() != 0 ? CL_SUCCESS : -1, "cl::Platform::get");
-	//std::cerr << "Platform number is: " << platformList.size() << std::endl;
+	auto all = get_all_devices();
+	checkErr2(all.size() != 0 ? CL_SUCCESS : -1, "cl::Platform::get");
 
-	int id = 0;
-	for (auto it = platformList.begin(); it < platformList.end(); it++, id++)
+	std::stringstream ss;
+	if (idx == (int)all.size() && all.size() > 1)
+		ss << "OpenCL on all " << all.size() << " devices";
+	else if (idx >= 0 && idx < (int)all.size())
 	{
-		if (idx == id)
-		{
-			std::string platformVendor;
-			std::string platformName;
-			it->getInfo((cl_platform_info)CL_PLATFORM_VENDOR, &platformVendor);
-			it->getInfo((cl_platform_info)CL_PLATFORM_NAME, &platformName);
+		std::string deviceName;
+		std::string platformName;
+		cl::Platform platform(all[idx].getInfo<CL_DEVICE_PLATFORM>());
+		all[idx].getInfo(CL_DEVICE_NAME, &deviceName);
+		platform.getInfo((cl_platform_info)CL_PLATFORM_NAME, &platformName);
+		ss << "OpenCL " << deviceName << " (" << platformName << ")";
+	}
+	else
+		return NULL;
 
-			std::stringstream ss;
-			ss << "OpenCL " << platformName << " (" << platformVendor << ")" << std::endl;
+	auto str = ss.str();
+	str.erase(str.find_last_not_of(" \n\r\t")+1);
 
-			auto str = ss.str();
-			str.erase(str.find_last_not_of(" \n\r\t")+1);
+	char *ret = new char[str.size() + 1];
+	std::copy(str.begin(), str.end(), ret);
+	ret[str.size()] = '\0'; // don't forget the terminating 0
+	return ret;
+}
 
-			char *ret = new char[str.size() + 1];
-			std::copy(str.begin(), str.end(), ret);
-			ret[str.size()] = '\0'; // don't forget the terminating 0
-			return ret;
-		}
+/* Wait for the frame in a slot and copy its results out */
+static cl_int retire_slot(opencl_dev *d, opencl_slot *s)
+{
+	if (!s->result)
+		return CL_SUCCESS;
+
+	auto result = s->result;
+	s->result = NULL;
+
+	auto err = s->done.wait();
+	if (err != CL_SUCCESS)
+		*result = err;
+	checkErr(err, "Event::wait()");
+
+	auto out_size = s->pix_count * otype_size(d->otype);
+	auto host_x = s->host_out;
+	auto host_y = host_x + s->buf_pix_count * otype_size(d->otype);
+	auto host_z = host_y + s->buf_pix_count * otype_size(d->otype);
+	auto host_m = host_z + s->buf_pix_count * otype_size(d->otype);
+
+	memcpy(s->x, host_x, out_size);
+	memcpy(s->y, host_y, out_size);
+	memcpy(s->z, host_z, out_size);
+	if (s->m)
+		memcpy(s->m, host_m, s->pix_count * 2);
+
+	/* Time the device from the start of the upload to the end of the
+		readback, for splitting later frames */
+	cl_ulong t0, t1;
+	if (s->start.getProfilingInfo(CL_PROFILING_COMMAND_START, &t0) == CL_SUCCESS &&
+		s->done.getProfilingInfo(CL_PROFILING_COMMAND_END, &t1) == CL_SUCCESS &&
+		t1 > t0)
+	{
+		auto rate = (double)s->pix_count * 1e9 / (double)(t1 - t0);
+		d->rate = d->timed ? 0.5 * (d->rate + rate) : rate;
+		d->timed = 1;
 	}
 
-	return NULL;
+	return CL_SUCCESS;
+}
+
+/* Drop the frame in a slot without copying its results out, once the
+	device has finished with the slot's staging.  For the parts of a
+	frame whose submission failed on another device. */
+static void abandon_slot(opencl_slot *s)
+{
+	if (s->queue())
+		s->queue.finish();
+
+	s->result = NULL;
+	s->x = s->y = s->z = NULL;
+	s->m = NULL;
+}
+
+static void release_buffers(opencl_dev *d, opencl_slot *s)
+{
+	retire_slot(d, s);
+
+	if (s->host_in)
+		s->queue.enqueueUnmapMemObject(s->pin_in, s->host_in);
+	if (s->host_out)
+		s->queue.enqueueUnmapMemObject(s->pin_out, s->host_out);
+	if (s->queue())
+		s->queue.finish();
+
+	s->ina = s->inb = s->outx = s->outy = s->outz = s->outm = cl::Buffer();
+	s->pin_in = s->pin_out = cl::Buffer();
+	s->host_in = s->host_out = NULL;
+	s->buf_pix_count = 0;
 }
 
-int opencl_init(int platform, int enhanced, int use_single_fp,
-	libdect_output_type otype)
+/* Ensure the persistent buffers of a slot can hold pix_count pixels */
+static cl_int grow_buffers(opencl_dev *d, opencl_slot *s, size_t pix_count)
 {
 	cl_int err;
-	is_init = 0;
 
-	std::vector<cl::Platform> platformList;
-	cl::Platform::get(&platformList);
-	checkErr(platformList.size() != 0 ? CL_SUCCESS : -1, "cl::Platform::get");
+	if (pix_count <= s->buf_pix_count)
+		return CL_SUCCESS;
 
-	checkErr(platform < (int)platformList.size() ? CL_SUCCESS : -1, "invalid platform");
+	release_buffers(d, s);
 
-	cl_context_properties cprops[3] = { CL_CONTEXT_PLATFORM, (cl_context_properties)(platformList[platform])(), 0 };
+	auto in_size = pix_count * 2;
+	auto out_size = pix_count * otype_size(d->otype);
 
-	context = new cl::Context(
-		CL_DEVICE_TYPE_GPU,
-		cprops,
-		NULL,
-		NULL,
-		&err);
+	s->ina = cl::Buffer(d->context, CL_MEM_READ_ONLY, in_size, NULL, &err);
+	checkErr(err, "Buffer::Buffer()");
+	s->inb = cl::Buffer(d->context, CL_MEM_READ_ONLY, in_size, NULL, &err);
+	checkErr(err, "Buffer::Buffer()");
+	s->outx = cl::Buffer(d->context, CL_MEM_WRITE_ONLY, out_size, NULL, &err);
+	checkErr(err, "Buffer::Buffer()");
+	s->outy = cl::Buffer(d->context, CL_MEM_WRITE_ONLY, out_size, NULL, &err);
+	checkErr(err, "Buffer::Buffer()");
+	s->outz = cl::Buffer(d->context, CL_MEM_WRITE_ONLY, out_size, NULL, &err);
+	checkErr(err, "Buffer::Buffer()");
+	s->outm = cl::Buffer(d->context, CL_MEM_WRITE_ONLY, in_size, NULL, &err);
+	checkErr(err, "Buffer::Buffer()");
 
-	if (err != CL_SUCCESS)
+	/* Staging for a then b, and for x, y, z then m */
+	s->pin_in = cl::Buffer(d->context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR,
+		in_size * 2, NULL, &err);
+	checkErr(err, "Buffer::Buffer()");
+	s->pin_out = cl::Buffer(d->context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR,
+		out_size * 3 + in_size, NULL, &err);
+	checkErr(err, "Buffer::Buffer()");
+
+	s->host_in = (uint8_t *)s->queue.enqueueMapBuffer(s->pin_in, CL_TRUE,
+		CL_MAP_READ | CL_MAP_WRITE, 0, in_size * 2, NULL, NULL, &err);
+	checkErr(err, "CommandQueue::enqueueMapBuffer()");
+	s->host_out = (uint8_t *)s->queue.enqueueMapBuffer(s->pin_out, CL_TRUE,
+		CL_MAP_READ | CL_MAP_WRITE, 0, out_size * 3 + in_size, NULL, NULL, &err);
+	checkErr(err, "CommandQueue::enqueueMapBuffer()");
+
+	s->buf_pix_count = pix_count;
+	return CL_SUCCESS;
+}
+
+void opencl_destroy(opencl_context *ocl)
+{
+	if (!ocl)
+		return;
+
+	for (auto it = ocl->devs.begin(); it < ocl->devs.end(); it++)
 	{
-		context = new cl::Context(
-			CL_DEVICE_TYPE_DEFAULT,
-			cprops,
-			NULL,
-			NULL,
-			&err);
+		for (int i = 0; i < OPENCL_SLOTS; i++)
+			release_buffers(*it, &(*it)->slots[i]);
+		delete *it;
 	}
+	delete ocl;
+}
 
-	checkErr(err, "Context::Context()");
+/* The kernel source for an output type, calculating in double or single
+	precision, with any extra defines placed before the kernels */
+static std::string kernel_source(int dp, libdect_output_type otype,
+	const std::string &defines)
+{
+	std::string src = dp ? "#define FPTYPE double\n" : "#define FPTYPE float\n";
 
-	devices = context->getInfo<CL_CONTEXT_DEVICES>();
-	checkErr(devices.size() > 0 ? CL_SUCCESS : -1, "devices.size() > 0");
+	switch (otype)
+	{
+	case libdect_output_type::u8:
+		src.append("#define OTYPE uchar\n#define OTYPE_MAX 255.0\n");
+		break;
+	case libdect_output_type::u16:
+		src.append("#define OTYPE ushort\n#define OTYPE_MAX 65535.0\n");
+		break;
+	case libdect_output_type::f32:
+		src.append("#define OTYPE float\n#define OTYPE_MAX 1.0\n#define FLOOR_FUNC \n");
+		break;
+	case libdect_output_type::f64:
+		src.append("#define OTYPE double\n#define OTYPE_MAX 1.0\n#define FLOOR_FUNC \n");
+		break;
+	}
 
-	std::string f8_kern = std::string("#define FPTYPE float\n#define OTYPE uchar\n#define OTYPE_MAX 255.0\n").append(ks);
-	std::string f16_kern = std::string("#define FPTYPE float\n#define OTYPE ushort\n#define OTYPE_MAX 65535.0\n").append(ks);
-	std::string d8_kern = std::string("#define FPTYPE double\n#define OTYPE uchar\n#define OTYPE_MAX 255.0\n").append(ks);
-	std::string d16_kern = std::string("#define FPTYPE double\n#define OTYPE ushort\n#define OTYPE_MAX 65535.0\n").append(ks);
-	std::string ff32_kern = std::string("#define FPTYPE float\n#define OTYPE float\n#define OTYPE_MAX 1.0\n#define FLOOR_FUNC \n").append(ks);
-	std::string df32_kern = std::string("#define FPTYPE double\n#define OTYPE float\n#define OTYPE_MAX 1.0\n#define FLOOR_FUNC \n").append(ks);
-	std::string ff64_kern = std::string("#define FPTYPE float\n#define OTYPE double\n#define OTYPE_MAX 1.0\n#define FLOOR_FUNC \n").append(ks);
-	std::string df64_kern = std::string("#define FPTYPE double\n#define OTYPE double\n#define OTYPE_MAX 1.0\n#define FLOOR_FUNC \n").append(ks);
-	_otype = otype;
+	return src.append(defines).append(ks);
+}
 
-	if (use_single_fp)
-		err = CL_BUILD_ERROR;	// force attempt to use single fp
+static inline cl_int set_float_arg(opencl_dev *d, cl::Kernel &kernel,
+	cl_uint index, float val)
+{
+	if (d->use_double)
+		return kernel.setArg(index, (double)val);
 	else
+		return kernel.setArg(index, (float)val);
+}
+
+template <typename T>
+static void append_table(std::stringstream &ss, const T *vals, size_t count)
+{
+	ss << "{ ";
+	for (size_t i = 0; i < count; i++)
+		ss << (i ? ", " : "") << (double)vals[i];
+	ss << " }";
+}
+
+/* The most points the coarse grid can have, with room for the rounding
+	of its steps */
+#define COARSE_MAX 144
+
+/* Defines which bake the densities and min_step into the kernels.  The
+	coarse grid search only depends on the densities, so its predictions
+	are worked out once by the general program's coarse_table kernel, with
+	exactly the arithmetic the general kernels use on this device, and
+	placed in constant memory. */
+template <typename FP>
+static cl_int special_defines(opencl_dev *d,
+	float alphaa, float betaa, float gammaa,
+	float alphab, float betab, float gammab,
+	float min_step, std::string &defines)
+{
+	cl_int err;
+	int perms = d->enhanced == 3 ? 3 : 1;
+	std::vector<FP> ab(COARSE_MAX), ratio(COARSE_MAX);
+	std::vector<FP> a_est(perms * COARSE_MAX), b_est(perms * COARSE_MAX);
+	cl_int count = 0;
+
+	cl::Buffer ab_buf(d->context, CL_MEM_WRITE_ONLY, ab.size() * sizeof(FP), NULL, &err);
+	checkErr(err, "Buffer::Buffer()");
+	cl::Buffer ratio_buf(d->context, CL_MEM_WRITE_ONLY, ratio.size() * sizeof(FP), NULL, &err);
+	checkErr(err, "Buffer::Buffer()");
+	cl::Buffer a_est_buf(d->context, CL_MEM_WRITE_ONLY, a_est.size() * sizeof(FP), NULL, &err);
+	checkErr(err, "Buffer::Buffer()");
+	cl::Buffer b_est_buf(d->context, CL_MEM_WRITE_ONLY, b_est.size() * sizeof(FP), NULL, &err);
+	checkErr(err, "Buffer::Buffer()");
+	cl::Buffer count_buf(d->context, CL_MEM_WRITE_ONLY, sizeof(cl_int), NULL, &err);
+	checkErr(err, "Buffer::Buffer()");
+
+	auto &kernel = d->coarse_kernel;
+	float densities[] = { alphaa, betaa, gammaa, alphab, betab, gammab };
+	for (cl_uint i = 0; i < 6; i++)
+	{
+		err = set_float_arg(d, kernel, i, densities[i]);
+		checkErr(err, "Kernel::setArg()");
+	}
+	err = kernel.setArg(6, (cl_int)d->enhanced);
+	checkErr(err, "Kernel::setArg(6)");
+	err = kernel.setArg(7, (cl_int)COARSE_MAX);
+	checkErr(err, "Kernel::setArg(7)");
+	err = kernel.setArg(8, ab_buf);
+	checkErr(err, "Kernel::setArg(8)");
+	err = kernel.setArg(9, ratio_buf);
+	checkErr(err, "Kernel::setArg(9)");
+	err = kernel.setArg(10, a_est_buf);
+	checkErr(err, "Kernel::setArg(10)");
+	err = kernel.setArg(11, b_est_buf);
+	checkErr(err, "Kernel::setArg(11)");
+	err = kernel.setArg(12, count_buf);
+	checkErr(err, "Kernel::setArg(12)");
+
+	auto &queue = d->slots[0].queue;
+	err = queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(perms),
+		cl::NullRange);
+	checkErr(err, "CommandQueue::enqueueNDRangeKernel()");
+	err = queue.enqueueReadBuffer(ab_buf, CL_FALSE, 0, ab.size() * sizeof(FP), ab.data());
+	checkErr(err, "CommandQueue::enqueueReadBuffer()");
+	err = queue.enqueueReadBuffer(ratio_buf, CL_FALSE, 0, ratio.size() * sizeof(FP), ratio.data());
+	checkErr(err, "CommandQueue::enqueueReadBuffer()");
+	err = queue.enqueueReadBuffer(a_est_buf, CL_FALSE, 0, a_est.size() * sizeof(FP), a_est.data());
+	checkErr(err, "CommandQueue::enqueueReadBuffer()");
+	err = queue.enqueueReadBuffer(b_est_buf, CL_FALSE, 0, b_est.size() * sizeof(FP), b_est.data());
+	checkErr(err, "CommandQueue::enqueueReadBuffer()");
+	err = queue.enqueueReadBuffer(count_buf, CL_TRUE, 0, sizeof(cl_int), &count);
+	checkErr(err, "CommandQueue::enqueueReadBuffer()");
+	checkErr(count > 0 && count <= COARSE_MAX ? CL_SUCCESS : CL_INVALID_VALUE,
+		"coarse_table");
+
+	std::stringstream ss;
+	ss << std::hexfloat;
+	ss << "#define SPECIALIZED\n";
+	ss << "#define SP_ALPHAA ((FPTYPE)" << (double)alphaa << ")\n";
+	ss << "#define SP_BETAA ((FPTYPE)" << (double)betaa << ")\n";
+	ss << "#define SP_GAMMAA ((FPTYPE)" << (double)gammaa << ")\n";
+	ss << "#define SP_ALPHAB ((FPTYPE)" << (double)alphab << ")\n";
+	ss << "#define SP_BETAB ((FPTYPE)" << (double)betab << ")\n";
+	ss << "#define SP_GAMMAB ((FPTYPE)" << (double)gammab << ")\n";
+	ss << "#define SP_MIN_STEP ((FPTYPE)" << (double)min_step << ")\n";
+	ss << "#define COARSE_COUNT " << count << "\n";
+
+	ss << "constant FPTYPE coarse_ab[COARSE_COUNT] = ";
+	append_table(ss, ab.data(), count);
+	ss << ";\nconstant FPTYPE coarse_ratio[COARSE_COUNT] = ";
+	append_table(ss, ratio.data(), count);
+	ss << ";\nconstant FPTYPE coarse_a_est[" << perms << "][COARSE_COUNT] = { ";
+	for (int i = 0; i < perms; i++)
+	{
+		ss << (i ? ", " : "");
+		append_table(ss, a_est.data() + i * COARSE_MAX, count);
+	}
+	ss << " };\nconstant FPTYPE coarse_b_est[" << perms << "][COARSE_COUNT] = { ";
+	for (int i = 0; i < perms; i++)
+	{
+		ss << (i ? ", " : "");
+		append_table(ss, b_est.data() + i * COARSE_MAX, count);
+	}
+	ss << " };\n";
+
+	defines = ss.str();
+	return CL_SUCCESS;
+}
+
+static uint64_t hash_string(const std::string &s)
+{
+	/* FNV-1a */
+	uint64_t h = 14695981039346656037ULL;
+	for (auto it = s.begin(); it < s.end(); it++)
 	{
-		const char *cstr;
-		size_t len;
+		h ^= (uint8_t)*it;
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+/* DECT_CACHE_DIR, or the user's cache directory */
+static std::filesystem::path cache_dir()
+{
+	if (auto dir = getenv("DECT_CACHE_DIR"))
+		return std::filesystem::path(dir);
+#ifdef _WIN32
+	if (auto dir = getenv("LOCALAPPDATA"))
+		return std::filesystem::path(dir) / "dect" / "cache";
+#else
+	if (auto dir = getenv("XDG_CACHE_HOME"))
+		return std::filesystem::path(dir) / "dect";
+	if (auto dir = getenv("HOME"))
+		return std::filesystem::path(dir) / ".cache" / "dect";
+#endif
+	return std::filesystem::path();
+}
+
+static std::filesystem::path cache_path(const std::string &key)
+{
+	auto dir = cache_dir();
+	if (dir.empty())
+		return dir;
+
+	std::stringstream ss;
+	ss << std::hex << hash_string(key) << ".bin";
+	return dir / ss.str();
+}
 
-		switch (otype)
+/* The device, its driver, the build options and the source */
+static std::string cache_key(const opencl_dev *d, const std::string &src,
+	const char *options)
+{
+	std::string platformVersion;
+	cl::Platform platform(d->device.getInfo<CL_DEVICE_PLATFORM>());
+	platform.getInfo((cl_platform_info)CL_PLATFORM_VERSION, &platformVersion);
+
+	std::stringstream ss;
+	ss << d->device.getInfo<CL_DEVICE_VENDOR>() << "|" <<
+		d->device.getInfo<CL_DEVICE_NAME>() << "|" <<
+		d->device.getInfo<CL_DRIVER_VERSION>() << "|" <<
+		platformVersion << "|" << options << "|" <<
+		std::hex << hash_string(src);
+
+	auto key = ss.str();
+	key.erase(std::remove(key.begin(), key.end(), '\n'), key.end());
+	key.erase(std::remove(key.begin(), key.end(), '\0'), key.end());
+	return key;
+}
+
+/* Returns 1 if the cache has an entry for key.  An empty binary means the
+	program is known not to build. */
+static int cache_load(const std::string &key, std::vector<unsigned char> &binary)
+{
+	auto path = cache_path(key);
+	if (path.empty())
+		return 0;
+
+	std::ifstream f(path, std::ios::binary);
+	if (!f)
+		return 0;
+
+	std::string magic, stored_key;
+	if (!std::getline(f, magic) || magic != PROGRAM_CACHE_MAGIC ||
+		!std::getline(f, stored_key) || stored_key != key)
+		return 0;
+
+	binary.assign(std::istreambuf_iterator<char>(f),
+		std::istreambuf_iterator<char>());
+	return 1;
+}
+
+static void cache_save(const std::string &key,
+	const std::vector<unsigned char> &binary)
+{
+	auto path = cache_path(key);
+	if (path.empty())
+		return;
+
+	std::error_code ec;
+	std::filesystem::create_directories(path.parent_path(), ec);
+
+	/* Write then rename, so other processes never see part of a file */
+	std::stringstream tmp_name;
+	tmp_name << path.filename().string() << "." << std::hex <<
+		hash_string(std::to_string((uintptr_t)&binary) + key) << ".tmp";
+	auto tmp = path.parent_path() / tmp_name.str();
+
+	{
+		std::ofstream f(tmp, std::ios::binary);
+		if (!f)
+			return;
+		f << PROGRAM_CACHE_MAGIC << "\n" << key << "\n";
+		f.write((const char *)binary.data(), binary.size());
+		if (!f)
 		{
-			case libdect_output_type::u8:
-				cstr = d8_kern.c_str();
-				len = d8_kern.length();
-				break;
-			case libdect_output_type::u16:
-				cstr = d16_kern.c_str();
-				len = d16_kern.length();
-				break;
-			case libdect_output_type::f32:
-				cstr = df32_kern.c_str();
-				len = df32_kern.length();
-				break;
-			case libdect_output_type::f64:
-				cstr = df64_kern.c_str();
-				len = df64_kern.length();
-				break;
-			default:
-				return -1;
+			f.close();
+			std::filesystem::remove(tmp, ec);
+			return;
 		}
+	}
 
-		cl::Program::Sources source(
-			1,
-			std::make_pair(cstr, len + 1));
+	std::filesystem::rename(tmp, path, ec);
+	if (ec)
+		std::filesystem::remove(tmp, ec);
+}
 
-		program = new cl::Program(*context, source);
-		err = program->build(devices, "");
-	}
+static cl_int build_program(opencl_dev *d, const std::string &src,
+	int use_cache, cl::Program &program)
+{
+	cl_int err;
+	auto devices = std::vector<cl::Device>(1, d->device);
+	const char *options = "";
 
-	if (err != CL_SUCCESS)
+	std::string key;
+	if (use_cache)
 	{
-		const char *cstr;
-		size_t len;
+		std::vector<unsigned char> binary;
+		key = cache_key(d, src, options);
 
-		switch (otype)
+		if (cache_load(key, binary))
 		{
-		case libdect_output_type::u8:
-			cstr = f8_kern.c_str();
-			len = f8_kern.length();
-			break;
-		case libdect_output_type::u16:
-			cstr = f16_kern.c_str();
-			len = f16_kern.length();
-			break;
-		case libdect_output_type::f32:
-			cstr = ff32_kern.c_str();
-			len = ff32_kern.length();
-			break;
-		case libdect_output_type::f64:
-			cstr = ff64_kern.c_str();
-			len = ff64_kern.length();
-			break;
-		default:
-			return -1;
+			if (binary.empty())
+				return CL_BUILD_PROGRAM_FAILURE;
+
+			cl::Program::Binaries binaries(
+				1,
+				std::make_pair((const void *)binary.data(), binary.size()));
+
+			program = cl::Program(d->context, devices, binaries, NULL, &err);
+			if (err == CL_SUCCESS)
+				err = program.build(devices, options);
+			if (err == CL_SUCCESS)
+				return CL_SUCCESS;
+
+			/* Otherwise build from source and replace the entry */
 		}
-		cl::Program::Sources source2(
-			1,
-			std::make_pair(cstr, len + 1));
+	}
+
+	cl::Program::Sources source(
+		1,
+		std::make_pair(src.c_str(), src.length() + 1));
+
+	program = cl::Program(d->context, source, &err);
+	checkErr(err, "Program::Program()");
 
-		program = new cl::Program(*context, source2);
-		err = program->build(devices, "");
-		use_double = 0;
+	err = program.build(devices, options);
+
+	if (use_cache)
+	{
+		if (err == CL_SUCCESS)
+		{
+			cl_int info_err;
+			auto binaries = program.getInfo<CL_PROGRAM_BINARIES>(&info_err);
+			if (info_err == CL_SUCCESS && binaries.size() == 1 &&
+				binaries[0].size() > 0)
+				cache_save(key, binaries[0]);
+		}
+		else if (err == CL_BUILD_PROGRAM_FAILURE)
+		{
+			/* Remember that it fails, e.g. for double precision on a
+				device without it, so it is not retried every run */
+			cache_save(key, std::vector<unsigned char>());
+		}
 	}
+
+	return err;
+}
+
+static cl_int init_device(opencl_dev *d, int enhanced, int use_single_fp,
+	libdect_output_type otype, int use_cache, int specialize)
+{
+	cl_int err;
+
+	d->enhanced = enhanced;
+	d->otype = otype;
+	d->use_cache = use_cache;
+	d->specialize = specialize;
+
+	d->context = cl::Context(d->device, NULL, NULL, NULL, &err);
+	checkErr(err, "Context::Context()");
+
+	d->use_double = 0;
+	if (use_single_fp)
+		err = CL_BUILD_ERROR;	// force attempt to use single fp
+	else
+	{
+		err = build_program(d, kernel_source(1, otype, ""), use_cache,
+			d->program);
+		d->use_double = err == CL_SUCCESS;
+	}
+
+	if (err != CL_SUCCESS)
+		err = build_program(d, kernel_source(0, otype, ""), use_cache,
+			d->program);
 	checkErr(err, "Program::build()");
 
-	kernel = new cl::Kernel(*program, enhanced == 3 ? "dect2" : "dect", &err);
+	d->kernel = cl::Kernel(d->program, enhanced == 3 ? "dect2" : "dect", &err);
+	checkErr(err, "Kernel::Kernel()");
+	d->simul_kernel = cl::Kernel(d->program, "simul", &err);
+	checkErr(err, "Kernel::Kernel()");
+	d->reconstitute_kernel = cl::Kernel(d->program, "reconstitute", &err);
+	checkErr(err, "Kernel::Kernel()");
+	d->coarse_kernel = cl::Kernel(d->program, "coarse_table", &err);
 	checkErr(err, "Kernel::Kernel()");
 
-	queue = new cl::CommandQueue(*context, devices[0], 0, &err);
-	checkErr(err, "CommandQueue::CommandQueue()");
-	
-	device = devices[0];
+	for (int i = 0; i < OPENCL_SLOTS; i++)
+	{
+		d->slots[i].queue = cl::CommandQueue(d->context, d->device,
+			CL_QUEUE_PROFILING_ENABLE, &err);
+		checkErr(err, "CommandQueue::CommandQueue()");
+	}
 
-	if (use_double == 0 && use_single_fp == 0)
+	if (d->use_double == 0 && use_single_fp == 0)
 	{
 		printf("Warning: no double precision support in OpenCL device - defaulting to single\n");
 	}
 
-	/*cl_uint native_double_width = device.getInfo<CL_DEVICE_NATIVE_VECTOR_WIDTH_DOUBLE>();
-	if (native_double_width == 0) {
-		printf("No double precision support in OpenCL device.\n");
-		return -1;
-	}*/
+	/* A first guess at the relative speed, until a frame has been timed */
+	d->rate = (double)d->device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() *
+		(double)d->device.getInfo<CL_DEVICE_MAX_CLOCK_FREQUENCY>();
+	if (d->rate <= 0.0)
+		d->rate = 1.0;
+	d->timed = 0;
 
-	is_init = 1;
-	return 0;
+	return CL_SUCCESS;
 }
 
-static inline cl_int set_float_arg(cl::Kernel *kernel,
-	cl_uint index, float val)
+/* The kernel to use for a set of parameters.  Unless specializing, this
+	is the general kernel.  Specialized kernels are built the first time
+	their parameters are seen, and kept for the life of the device; the
+	program cache lets later runs with the same calibration skip the
+	compiler too. */
+static cl::Kernel &get_kernel(opencl_dev *d,
+	float alphaa, float betaa, float gammaa,
+	float alphab, float betab, float gammab,
+	float min_step)
+{
+	if (!d->specialize)
+		return d->kernel;
+
+	opencl_special_key key = { alphaa, betaa, gammaa, alphab, betab, gammab,
+		min_step, d->use_double };
+	auto it = d->special.find(key);
+	if (it != d->special.end())
+		return it->second;
+
+	/* A failed build is remembered as the general kernel */
+	cl::Kernel kernel = d->kernel;
+	std::string defines;
+	auto err = d->use_double ?
+		special_defines<double>(d, alphaa, betaa, gammaa,
+			alphab, betab, gammab, min_step, defines) :
+		special_defines<float>(d, alphaa, betaa, gammaa,
+			alphab, betab, gammab, min_step, defines);
+
+	cl::Program program;
+	if (err == CL_SUCCESS && build_program(d,
+		kernel_source(d->use_double, d->otype, defines),
+		d->use_cache, program) == CL_SUCCESS)
+	{
+		cl::Kernel special(program, d->enhanced == 3 ? "dect2" : "dect", &err);
+		if (err == CL_SUCCESS)
+			kernel = special;
+	}
+
+	return d->special[key] = kernel;
+}
+
+/* Use device idx, or every device if idx is one past the last.  Returns
+	NULL if no device could be set up. */
+opencl_context *opencl_create(int idx, int enhanced, int use_single_fp,
+	libdect_output_type otype, int use_cache, int specialize)
 {
-	if (use_double)
-		return kernel->setArg(index, (double)val);
+	auto all = get_all_devices();
+	checkErr2(all.size() != 0 ? CL_SUCCESS : -1, "cl::Platform::get");
+
+	std::vector<cl::Device> use;
+	if (idx == (int)all.size() && all.size() > 1)
+		use = all;
 	else
-		return kernel->setArg(index, (float)val);
+	{
+		checkErr2(idx >= 0 && idx < (int)all.size() ? CL_SUCCESS : -1, "invalid device");
+		use.push_back(all[idx]);
+	}
+
+	auto ocl = new opencl_context();
+	ocl->next_ticket = 0;
+
+	for (auto it = use.begin(); it < use.end(); it++)
+	{
+		auto d = new opencl_dev();
+		d->device = *it;
+
+		/* Carry on with the other devices if there are any */
+		if (init_device(d, enhanced, use_single_fp, otype, use_cache,
+			specialize) != CL_SUCCESS)
+		{
+			delete d;
+			continue;
+		}
+		ocl->devs.push_back(d);
+	}
+
+	if (ocl->devs.empty())
+	{
+		std::cerr << "ERROR: no OpenCL device could be initialised" << std::endl;
+		delete ocl;
+		return NULL;
+	}
+
+	return ocl;
 }
 
-int dect_algo_opencl(int enhanced,
+/* Queue part of a frame on a device, in the slot for ticket.  With simul
+	it is solved with the simultaneous equations rather than searched.
+	The inputs are XORed with in_flip on their way to the staging buffers,
+	which moves unsigned inputs into the signed range without another
+	pass over them. */
+static cl_int submit_part(opencl_dev *d, size_t ticket,
 	const int16_t *a, const int16_t *b,
 	float alphaa, float betaa, float gammaa,
 	float alphab, float betab, float gammab,
@@ -287,173 +817,393 @@ int dect_algo_opencl(int enhanced,
 	float min_step,
 	int16_t *m,
 	float mr,
-	int idx_adjust)
+	int idx_adjust,
+	int simul,
+	int in_flip,
+	int *result)
 {
 	cl_int err;
 
-	if (is_init == 0)
-		return -1;
+	auto in_size = pix_count * 2;
+	auto out_size = pix_count * otype_size(d->otype);
+
+	auto s = &d->slots[ticket % OPENCL_SLOTS];
+
+	/* The frame previously in this slot must be copied out before its
+		staging is reused.  Its status goes to its own result. */
+	retire_slot(d, s);
+
+	err = grow_buffers(d, s, pix_count);
+	checkErr(err, "grow_buffers()");
 
-	auto out_size = pix_count;
-	switch (_otype)
+	auto host_a = s->host_in;
+	auto host_b = s->host_in + s->buf_pix_count * 2;
+	auto host_x = s->host_out;
+	auto host_y = host_x + s->buf_pix_count * otype_size(d->otype);
+	auto host_z = host_y + s->buf_pix_count * otype_size(d->otype);
+	auto host_m = host_z + s->buf_pix_count * otype_size(d->otype);
+
+	/* Upload the inputs from pinned memory */
+	if (in_flip)
 	{
-	case libdect_output_type::u16:
-		out_size *= 2;
-		break;
-	case libdect_output_type::f32:
-		out_size *= 4;
-		break;
-	case libdect_output_type::f64:
-		out_size *= 8;
-		break;
+		auto stage_a = (int16_t *)host_a;
+		auto stage_b = (int16_t *)host_b;
+		for (size_t i = 0; i < pix_count; i++)
+		{
+			stage_a[i] = (int16_t)(a[i] ^ in_flip);
+			stage_b[i] = (int16_t)(b[i] ^ in_flip);
+		}
+	}
+	else
+	{
+		memcpy(host_a, a, in_size);
+		memcpy(host_b, b, in_size);
 	}
 
-	/* Build output buffers */
-	cl::Buffer outx(
-		*context,
-		CL_MEM_WRITE_ONLY,
-		out_size,
-		NULL,
-		&err);
-	checkErr(err, "Buffer::Buffer()");
-	cl::Buffer outy(
-		*context,
-		CL_MEM_WRITE_ONLY,
-		out_size,
-		NULL,
-		&err);
-	checkErr(err, "Buffer::Buffer()");
-	cl::Buffer outz(
-		*context,
-		CL_MEM_WRITE_ONLY,
-		out_size,
-		NULL,
-		&err);
-	checkErr(err, "Buffer::Buffer()");
+	err = s->queue.enqueueWriteBuffer(s->ina, CL_FALSE, 0, in_size, host_a,
+		NULL, &s->start);
+	checkErr(err, "CommandQueue::enqueueWriteBuffer()");
+	err = s->queue.enqueueWriteBuffer(s->inb, CL_FALSE, 0, in_size, host_b);
+	checkErr(err, "CommandQueue::enqueueWriteBuffer()");
 
-	cl::Buffer outm(
-		*context,
-		CL_MEM_WRITE_ONLY,
-		m ? pix_count * 2 : sizeof(cl_mem),
-		NULL,
-		&err);
-	checkErr(err, "Buffer::Buffer()");
+	auto &kernel = simul ? d->simul_kernel : get_kernel(d, alphaa, betaa, gammaa,
+		alphab, betab, gammab, min_step);
 
-	/* Input buffers */
-	cl::Buffer ina(
-		*context,
-		CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR,
-		pix_count * 2,
-		(void*)a,
-		&err);
-	cl::Buffer inb(
-		*context,
-		CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR,
-		pix_count * 2,
-		(void*)b,
-		&err);
-
-	err = kernel->setArg(0, ina);
+	err = kernel.setArg(0, s->ina);
 	checkErr(err, "Kernel::setArg(0)");
-	err = kernel->setArg(1, inb);
+	err = kernel.setArg(1, s->inb);
 	checkErr(err, "Kernel::setArg(1)");
-	err = set_float_arg(kernel, 2, alphaa);
+	err = set_float_arg(d, kernel, 2, alphaa);
 	checkErr(err, "Kernel::setArg(2)");
-	err = set_float_arg(kernel, 3, betaa);
+	err = set_float_arg(d, kernel, 3, betaa);
 	checkErr(err, "Kernel::setArg(3)");
-	err = set_float_arg(kernel, 4, gammaa);
+	err = set_float_arg(d, kernel, 4, gammaa);
 	checkErr(err, "Kernel::setArg(4)");
-	err = set_float_arg(kernel, 5, alphab);
+	err = set_float_arg(d, kernel, 5, alphab);
 	checkErr(err, "Kernel::setArg(5)");
-	err = set_float_arg(kernel, 6, betab);
+	err = set_float_arg(d, kernel, 6, betab);
 	checkErr(err, "Kernel::setArg(6)");
-	err = set_float_arg(kernel, 7, gammab);
+	err = set_float_arg(d, kernel, 7, gammab);
 	checkErr(err, "Kernel::setArg(7)");
-	err = kernel->setArg(8, outx);
+	err = kernel.setArg(8, s->outx);
 	checkErr(err, "Kernel::setArg(8)");
-	err = kernel->setArg(9, outy);
+	err = kernel.setArg(9, s->outy);
 	checkErr(err, "Kernel::setArg(9)");
-	err = kernel->setArg(10, outz);
+	err = kernel.setArg(10, s->outz);
 	checkErr(err, "Kernel::setArg(10)");
-	err = set_float_arg(kernel, 11, min_step);
+	err = set_float_arg(d, kernel, 11, min_step);
 	checkErr(err, "Kernel::setArg(11)");
-	err = kernel->setArg(12, outm);
+	err = kernel.setArg(12, s->outm);
 	checkErr(err, "Kernel::setArg(12)");
-	err = set_float_arg(kernel, 13, mr);
+	err = set_float_arg(d, kernel, 13, mr);
 	checkErr(err, "Kernel::setArg(13)");
-	err = kernel->setArg(14, m ? 1 : 0);
+	err = kernel.setArg(14, m ? 1 : 0);
 	checkErr(err, "Kernel::setArg(14)");
-	err = kernel->setArg(15, idx_adjust);
+	err = kernel.setArg(15, idx_adjust);
 	checkErr(err, "Kernel::setArg(15)");
 
-	cl::Event event;
-
-	/* Run the kernel */
-	err = queue->enqueueNDRangeKernel(
-		*kernel,
+	/* Run the kernel.  The queue is in order, so the transfers either
+		side of it need no explicit waits. */
+	err = s->queue.enqueueNDRangeKernel(
+		kernel,
 		cl::NullRange,
 		cl::NDRange(pix_count),
-		cl::NullRange,
-		NULL,
-		&event);
+		cl::NullRange);
 	checkErr(err, "CommandQueue::enqueueNDRangeKernel()");
 
-	/* Wait for completion */
-	event.wait();
-
-	/* Get output buffers */
-	cl::Event eventx, eventy, eventz, eventm;
-	err = queue->enqueueReadBuffer(
-		outx,
-		CL_FALSE,
-		0,
-		out_size,
-		x,
-		NULL,
-		&eventx);
+	/* Get output buffers.  The last read completes the frame. */
+	err = s->queue.enqueueReadBuffer(s->outx, CL_FALSE, 0, out_size, host_x);
 	checkErr(err, "CommandQueue::enqueueReadBuffer()");
-
-	err = queue->enqueueReadBuffer(
-		outy,
-		CL_FALSE,
-		0,
-		out_size,
-		y,
-		NULL,
-		&eventy);
+	err = s->queue.enqueueReadBuffer(s->outy, CL_FALSE, 0, out_size, host_y);
 	checkErr(err, "CommandQueue::enqueueReadBuffer()");
-
-	err = queue->enqueueReadBuffer(
-		outz,
-		CL_FALSE,
-		0,
-		out_size,
-		z,
-		NULL,
-		&eventz);
-	checkErr(err, "CommandQueue::enqueueReadBuffer()");
-
 	if (m)
 	{
-		err = queue->enqueueReadBuffer(
-			outm,
-			CL_FALSE,
-			0,
-			pix_count * 2,
-			m,
-			NULL,
-			&eventm);
+		err = s->queue.enqueueReadBuffer(s->outz, CL_FALSE, 0, out_size, host_z);
+		checkErr(err, "CommandQueue::enqueueReadBuffer()");
+		err = s->queue.enqueueReadBuffer(s->outm, CL_FALSE, 0, in_size, host_m,
+			NULL, &s->done);
+		checkErr(err, "CommandQueue::enqueueReadBuffer()");
+	}
+	else
+	{
+		err = s->queue.enqueueReadBuffer(s->outz, CL_FALSE, 0, out_size, host_z,
+			NULL, &s->done);
 		checkErr(err, "CommandQueue::enqueueReadBuffer()");
 	}
 
-	// Need to wait for copying completion prior to
-	//  returning to main as next thing will be libtiff
-	//  writing these buffers
-	eventx.wait();
-	eventy.wait();
-	eventz.wait();
-	if (m)
-		eventm.wait();
+	err = s->queue.flush();
+	checkErr(err, "CommandQueue::flush()");
+
+	s->result = result;
+	s->x = x;
+	s->y = y;
+	s->z = z;
+	s->m = m;
+	s->pix_count = pix_count;
+	s->ticket = ticket;
+
+	return CL_SUCCESS;
+}
+
+/* Queue a frame without waiting for it, split between the devices in use.
+	It is processed in the enhanced mode the kernels were built for by
+	opencl_create.  Once the frame has been waited for with opencl_wait,
+	*result holds its status and the outputs have been written. */
+int opencl_submit(opencl_context *ocl,
+	const int16_t *a, const int16_t *b,
+	float alphaa, float betaa, float gammaa,
+	float alphab, float betab, float gammab,
+	void *x, void *y, void *z,
+	size_t pix_count,
+	float min_step,
+	int16_t *m,
+	float mr,
+	int idx_adjust,
+	int simul,
+	int in_flip,
+	int *result,
+	size_t *ticket)
+{
+	if (!ocl)
+		return -1;
+
+	auto &devs = ocl->devs;
+	*result = 0;
+	*ticket = ocl->next_ticket++;
+
+	double total_rate = 0.0;
+	for (auto it = devs.begin(); it < devs.end(); it++)
+		total_rate += (*it)->rate;
+
+	auto out_pix = otype_size(devs[0]->otype);
+	size_t off = 0;
+	for (size_t i = 0; i < devs.size(); i++)
+	{
+		auto count = pix_count - off;
+		if (i < devs.size() - 1)
+			count = std::min(count,
+				(size_t)((double)pix_count * devs[i]->rate / total_rate));
+		if (count == 0)
+			continue;
+
+		/* When rotating, voxel off + j is written to idx_adjust - off - j,
+			so the part's outputs end where the next part's begin */
+		auto out_off = idx_adjust ? (size_t)idx_adjust - off - (count - 1) : off;
+
+		auto err = submit_part(devs[i], *ticket,
+			a + off, b + off, alphaa, betaa, gammaa,
+			alphab, betab, gammab,
+			(uint8_t *)x + out_off * out_pix,
+			(uint8_t *)y + out_off * out_pix,
+			(uint8_t *)z + out_off * out_pix,
+			count, min_step, m ? m + out_off : NULL, mr,
+			idx_adjust ? (int)count - 1 : 0, simul, in_flip, result);
+		if (err != CL_SUCCESS)
+		{
+			/* The caller falls back to the CPU and may free the outputs
+				and result, so nothing queued for this frame may write to
+				them later */
+			for (size_t k = 0; k <= i; k++)
+			{
+				auto s = &devs[k]->slots[*ticket % OPENCL_SLOTS];
+				if (k == i || s->ticket == *ticket)
+					abandon_slot(s);
+			}
+		}
+		checkErr(err, "submit_part()");
+
+		off += count;
+	}
 
 	return 0;
 }
+
+/* Wait for a frame queued with opencl_submit */
+int opencl_wait(opencl_context *ocl, size_t ticket)
+{
+	int ret = 0;
+
+	if (!ocl)
+		return -1;
+
+	for (auto it = ocl->devs.begin(); it < ocl->devs.end(); it++)
+	{
+		auto s = &(*it)->slots[ticket % OPENCL_SLOTS];
+
+		/* Otherwise it was already retired when its slot was reused, or
+			the device had no part of the frame */
+		if (s->ticket == ticket)
+		{
+			auto err = retire_slot(*it, s);
+			if (ret == 0)
+				ret = err;
+		}
+	}
+
+	return ret;
+}
+
+int dect_algo_opencl(opencl_context *ocl,
+	const int16_t *a, const int16_t *b,
+	float alphaa, float betaa, float gammaa,
+	float alphab, float betab, float gammab,
+	void *x, void *y, void *z,
+	size_t pix_count,
+	float min_step,
+	int16_t *m,
+	float mr,
+	int idx_adjust,
+	int simul,
+	int in_flip)
+{
+	int result;
+	size_t ticket;
+
+	auto err = opencl_submit(ocl,
+		a, b, alphaa, betaa, gammaa,
+		alphab, betab, gammab, x, y, z, pix_count,
+		min_step, m, mr, idx_adjust, simul, in_flip, &result, &ticket);
+	if (err != 0)
+		return err;
+
+	opencl_wait(ocl, ticket);
+	return result;
+}
+
+/* The buffers of one device's part of a reconstitution */
+struct opencl_reconstitute_part
+{
+	opencl_dev *d;
+	cl::Buffer inx, iny, inz, outa, outb;
+};
+
+/* Queue count voxels of a reconstitution on a part's device, from off in
+	x, y and z to out_off in a and b */
+static cl_int reconstitute_part(opencl_reconstitute_part *p,
+	const void *x, const void *y, const void *z,
+	float alphaa, float betaa, float gammaa,
+	float alphab, float betab, float gammab,
+	int16_t *a, int16_t *b,
+	size_t off, size_t out_off, size_t count,
+	int idx_adjust)
+{
+	auto d = p->d;
+	auto out_pix = otype_size(d->otype);
+	cl_int err;
+
+	p->inx = cl::Buffer(d->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+		count * out_pix, (uint8_t *)x + off * out_pix, &err);
+	checkErr(err, "Buffer::Buffer()");
+	p->iny = cl::Buffer(d->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+		count * out_pix, (uint8_t *)y + off * out_pix, &err);
+	checkErr(err, "Buffer::Buffer()");
+	p->inz = cl::Buffer(d->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+		count * out_pix, (uint8_t *)z + off * out_pix, &err);
+	checkErr(err, "Buffer::Buffer()");
+	p->outa = cl::Buffer(d->context, CL_MEM_WRITE_ONLY, count * 2, NULL, &err);
+	checkErr(err, "Buffer::Buffer()");
+	p->outb = cl::Buffer(d->context, CL_MEM_WRITE_ONLY, count * 2, NULL, &err);
+	checkErr(err, "Buffer::Buffer()");
+
+	auto &kernel = d->reconstitute_kernel;
+	float dens[6] = { alphaa, betaa, gammaa, alphab, betab, gammab };
+
+	err = kernel.setArg(0, p->inx);
+	checkErr(err, "Kernel::setArg(0)");
+	err = kernel.setArg(1, p->iny);
+	checkErr(err, "Kernel::setArg(1)");
+	err = kernel.setArg(2, p->inz);
+	checkErr(err, "Kernel::setArg(2)");
+	for (cl_uint j = 0; j < 6; j++)
+	{
+		err = kernel.setArg(3 + j, dens[j]);
+		checkErr(err, "Kernel::setArg()");
+	}
+	err = kernel.setArg(9, p->outa);
+	checkErr(err, "Kernel::setArg(9)");
+	err = kernel.setArg(10, p->outb);
+	checkErr(err, "Kernel::setArg(10)");
+	err = kernel.setArg(11, idx_adjust ? (int)count - 1 : 0);
+	checkErr(err, "Kernel::setArg(11)");
+
+	/* The first slot's queue, after any frames already queued there */
+	auto &queue = d->slots[0].queue;
+	err = queue.enqueueNDRangeKernel(
+		kernel,
+		cl::NullRange,
+		cl::NDRange(count),
+		cl::NullRange);
+	checkErr(err, "CommandQueue::enqueueNDRangeKernel()");
+
+	err = queue.enqueueReadBuffer(p->outa, CL_FALSE, 0, count * 2, a + out_off);
+	checkErr(err, "CommandQueue::enqueueReadBuffer()");
+	err = queue.enqueueReadBuffer(p->outb, CL_FALSE, 0, count * 2, b + out_off);
+	checkErr(err, "CommandQueue::enqueueReadBuffer()");
+	err = queue.flush();
+	checkErr(err, "CommandQueue::flush()");
+
+	return CL_SUCCESS;
+}
+
+/* Work out the densities a and b of x, y and z, which are in the output
+	type the devices were set up for, split between the devices as frames
+	are.  Unlike frames this waits for the result, and it uses temporary
+	buffers since the inputs and outputs are the other way round.  Every
+	part queued is waited for, even when another fails, so that none of
+	them writes to a or b once this returns. */
+int opencl_reconstitute(opencl_context *ocl,
+	const void *x, const void *y, const void *z,
+	float alphaa, float betaa, float gammaa,
+	float alphab, float betab, float gammab,
+	int16_t *a, int16_t *b,
+	size_t pix_count,
+	int idx_adjust)
+{
+	if (!ocl)
+		return -1;
+
+	auto &devs = ocl->devs;
+	std::vector<opencl_reconstitute_part> parts;
+	int ret = 0;
+
+	double total_rate = 0.0;
+	for (auto it = devs.begin(); it < devs.end(); it++)
+		total_rate += (*it)->rate;
+
+	size_t off = 0;
+	for (size_t i = 0; i < devs.size() && ret == 0; i++)
+	{
+		auto d = devs[i];
+		auto count = pix_count - off;
+		if (i < devs.size() - 1)
+			count = std::min(count,
+				(size_t)((double)pix_count * d->rate / total_rate));
+		if (count == 0)
+			continue;
+
+		/* As for frames, a rotated part ends where the next one begins */
+		auto out_off = idx_adjust ? (size_t)idx_adjust - off - (count - 1) : off;
+
+		opencl_reconstitute_part p;
+		p.d = d;
+		ret = reconstitute_part(&p, x, y, z,
+			alphaa, betaa, gammaa, alphab, betab, gammab,
+			a, b, off, out_off, count, idx_adjust);
+
+		/* A part which failed may still have queued some of its work */
+		parts.push_back(p);
+		off += count;
+	}
+
+	for (auto it = parts.begin(); it < parts.end(); it++)
+	{
+		auto err = it->d->slots[0].queue.finish();
+		if (err != CL_SUCCESS && ret == 0)
+		{
+			std::cerr << "ERROR: CommandQueue::finish() (" << err << ")" << std::endl;
+			ret = err;
+		}
+	}
+
+	return ret;
+}
@@ -0,0 +1,278 @@
+/* Copyright (C) 2016 by John Cronin
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#include <stdint.h>
+#include <math.h>
+#include <stddef.h>
+#include <algorithm>
+#include <type_traits>
+
+#define IN_LIBDECT
+#include "libdect.h"
+
+#ifndef _MSC_VER
+#ifdef __GNUC__
+#define RESTRICT __restrict
+#endif
+#else
+#define RESTRICT __restrict
+#endif
+
+/*
+	Reconstitution runs the model backwards, working out the densities
+	a and b that the fractions x, y and z of each voxel would give:
+
+		a = x * alphaa + y * betaa + z * gammaa
+		b = x * alphab + y * betab + z * gammab
+
+	It is used to check calibrations against the original images, so
+	the squared differences from them can be summed in the same pass,
+	each tile's while it is still in cache.
+	As for the simultaneous equations, the frame is split into tiles
+	shared between the threads and each tile is vectorized, with
+	clones for AVX-512, AVX2, SSE4.1 and the baseline on x86-64 Linux.
+*/
+
+#ifndef SIMD_CLONES
+#if defined(__GNUC__) && defined(__x86_64__) && defined(__linux__)
+#define SIMD_CLONES __attribute__((target_clones("avx512f", "avx2", "sse4.1", "default")))
+#else
+#define SIMD_CLONES
+#endif
+#endif
+
+/* Voxels handed to a thread at a time */
+#define RECONSTITUTE_TILE_SIZE 16384
+
+struct reconstitute_params
+{
+	float alphaa, betaa, gammaa;
+	float alphab, betab, gammab;
+	const int16_t *orig_a, *orig_b;
+};
+
+/* The largest output value, which stands for a fraction of 1.  Floating
+point outputs are the fraction itself. */
+template <typename OT> static inline float reconstitute_input_max()
+{
+	if constexpr (std::is_integral<OT>::value)
+		return (float)((1 << (8 * sizeof(OT))) - 1);
+	else
+		return 1.0f;
+}
+
+template <typename OT, bool ROTATE, bool ERR>
+SIMD_CLONES
+static void dect_algo_reconstitute_tile(const reconstitute_params *p,
+	const OT * RESTRICT x, const OT * RESTRICT y, const OT * RESTRICT z,
+	int16_t * RESTRICT a, int16_t * RESTRICT b,
+	size_t start, size_t count,
+	int idx_adjust,
+	double *err_a, double *err_b)
+{
+	const float alphaa = p->alphaa;
+	const float betaa = p->betaa;
+	const float gammaa = p->gammaa;
+	const float alphab = p->alphab;
+	const float betab = p->betab;
+	const float gammab = p->gammab;
+	const int16_t * RESTRICT orig_a = p->orig_a;
+	const int16_t * RESTRICT orig_b = p->orig_b;
+	const float imax = reconstitute_input_max<OT>();
+
+	/* Summed in single precision within the tile, which is short enough
+	not to lose anything that matters for an RMS */
+	float ea = 0.0f, eb = 0.0f;
+
+#pragma omp simd
+	for (size_t idx = start; idx < start + count; idx++)
+	{
+		float curx = (float)x[idx] / imax;
+		float cury = (float)y[idx] / imax;
+		float curz = (float)z[idx] / imax;
+
+		float cura = curx * alphaa + cury * betaa + curz * gammaa;
+		float curb = curx * alphab + cury * betab + curz * gammab;
+
+		size_t out_idx = ROTATE ? (size_t)idx_adjust - idx : idx;
+
+		a[out_idx] = (int16_t)cura;
+		b[out_idx] = (int16_t)curb;
+	}
+
+	/* The voxels just written, which rotated run backwards from the
+	end of the tile */
+	if (ERR)
+	{
+		size_t out_start = ROTATE ? (size_t)idx_adjust - (start + count - 1) : start;
+
+#pragma omp simd reduction(+:ea, eb)
+		for (size_t out_idx = out_start; out_idx < out_start + count; out_idx++)
+		{
+			float da = (float)a[out_idx] - (float)orig_a[out_idx];
+			float db = (float)b[out_idx] - (float)orig_b[out_idx];
+			ea += da * da;
+			eb += db * db;
+		}
+	}
+
+	*err_a = ea;
+	*err_b = eb;
+}
+
+template <typename OT, bool ERR> static void dect_algo_reconstitute_run(
+	const reconstitute_params *p,
+	const void *x, const void *y, const void *z,
+	int16_t *a, int16_t *b,
+	size_t pix_count,
+	int idx_adjust,
+	double *err_a, double *err_b)
+{
+	long long tiles = (long long)((pix_count + RECONSTITUTE_TILE_SIZE - 1) /
+		RECONSTITUTE_TILE_SIZE);
+	double ea = 0.0, eb = 0.0;
+
+#pragma omp parallel for schedule(static) reduction(+:ea, eb)
+	for (long long i = 0; i < tiles; i++)
+	{
+		size_t start = (size_t)i * RECONSTITUTE_TILE_SIZE;
+		size_t count = std::min((size_t)RECONSTITUTE_TILE_SIZE, pix_count - start);
+		double tile_a, tile_b;
+
+		if (idx_adjust)
+			dect_algo_reconstitute_tile<OT, true, ERR>(p,
+				(const OT *)x, (const OT *)y, (const OT *)z, a, b,
+				start, count, idx_adjust, &tile_a, &tile_b);
+		else
+			dect_algo_reconstitute_tile<OT, false, ERR>(p,
+				(const OT *)x, (const OT *)y, (const OT *)z, a, b,
+				start, count, idx_adjust, &tile_a, &tile_b);
+
+		ea += tile_a;
+		eb += tile_b;
+	}
+
+	*err_a = ea;
+	*err_b = eb;
+}
+
+template <typename OT> static void dect_algo_reconstitute_err(
+	const reconstitute_params *p,
+	const void *x, const void *y, const void *z,
+	int16_t *a, int16_t *b,
+	size_t pix_count,
+	int idx_adjust,
+	double *err_a, double *err_b)
+{
+	if (p->orig_a)
+		dect_algo_reconstitute_run<OT, true>(p, x, y, z, a, b,
+			pix_count, idx_adjust, err_a, err_b);
+	else
+		dect_algo_reconstitute_run<OT, false>(p, x, y, z, a, b,
+			pix_count, idx_adjust, err_a, err_b);
+}
+
+/* The RMS of sum squared differences err over count voxels */
+static void reconstitute_rms(double err_a, double err_b, size_t count,
+	double *rms_a, double *rms_b)
+{
+	if (rms_a)
+		*rms_a = count ? sqrt(err_a / (double)count) : 0.0;
+	if (rms_b)
+		*rms_b = count ? sqrt(err_b / (double)count) : 0.0;
+}
+
+/* Work out a and b from x, y and z in the output type otype.  With
+	orig_a and orig_b, the RMS differences of a and b from them are
+	returned in rms_a and rms_b, either of which may be NULL. */
+int dect_algo_reconstitute(
+	const void *x, const void *y, const void *z,
+	float alphaa, float betaa, float gammaa,
+	float alphab, float betab, float gammab,
+	int16_t *a, int16_t *b,
+	size_t pix_count,
+	int idx_adjust,
+	libdect_output_type otype,
+	const int16_t *orig_a, const int16_t *orig_b,
+	double *rms_a, double *rms_b)
+{
+	reconstitute_params p;
+	p.alphaa = alphaa;
+	p.betaa = betaa;
+	p.gammaa = gammaa;
+	p.alphab = alphab;
+	p.betab = betab;
+	p.gammab = gammab;
+	/* Both originals are needed to compare against either */
+	p.orig_a = orig_a && orig_b ? orig_a : NULL;
+	p.orig_b = orig_a && orig_b ? orig_b : NULL;
+
+	double err_a = 0.0, err_b = 0.0;
+
+	switch (otype)
+	{
+	case libdect_output_type::u8:
+		dect_algo_reconstitute_err<uint8_t>(&p, x, y, z, a, b,
+			pix_count, idx_adjust, &err_a, &err_b);
+		break;
+	case libdect_output_type::u16:
+		dect_algo_reconstitute_err<uint16_t>(&p, x, y, z, a, b,
+			pix_count, idx_adjust, &err_a, &err_b);
+		break;
+	case libdect_output_type::f32:
+		dect_algo_reconstitute_err<float>(&p, x, y, z, a, b,
+			pix_count, idx_adjust, &err_a, &err_b);
+		break;
+	case libdect_output_type::f64:
+		dect_algo_reconstitute_err<double>(&p, x, y, z, a, b,
+			pix_count, idx_adjust, &err_a, &err_b);
+		break;
+	default:
+		return -1;
+	}
+
+	if (p.orig_a)
+		reconstitute_rms(err_a, err_b, pix_count, rms_a, rms_b);
+	return 0;
+}
+
+/* The RMS differences of a and b, already reconstituted on another
+	device, from orig_a and orig_b */
+int dect_algo_reconstitute_rms(
+	const int16_t *a, const int16_t *b,
+	const int16_t *orig_a, const int16_t *orig_b,
+	size_t pix_count,
+	double *rms_a, double *rms_b)
+{
+	double err_a = 0.0, err_b = 0.0;
+
+#pragma omp parallel for simd schedule(static) reduction(+:err_a, err_b)
+	for (long long idx = 0; idx < (long long)pix_count; idx++)
+	{
+		double da = (double)a[idx] - (double)orig_a[idx];
+		double db = (double)b[idx] - (double)orig_b[idx];
+		err_a += da * da;
+		err_b += db * db;
+	}
+
+	reconstitute_rms(err_a, err_b, pix_count, rms_a, rms_b);
+	return 0;
+}